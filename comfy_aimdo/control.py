@@ -84,6 +84,18 @@ def init(implementation: str | None = None, simple_vram_headroom: int | None = N
     lib.get_devctx.argtypes = [ctypes.c_int]
     lib.get_devctx.restype = ctypes.c_void_p
 
+    lib.set_vram_pool_limit.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+    lib.set_vram_pool_limit.restype = None
+
+    lib.set_vbar_orphan_cache_limit.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+    lib.set_vbar_orphan_cache_limit.restype = None
+
+    lib.set_vram_reserve.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+    lib.set_vram_reserve.restype = ctypes.c_bool
+
+    lib.vbars_set_policy.argtypes = [ctypes.c_void_p, ctypes.c_int]
+    lib.vbars_set_policy.restype = ctypes.c_bool
+
     if simple_vram_headroom is not None:
         lib.set_simple_vram_headroom(int(simple_vram_headroom))
 
@@ -162,6 +174,53 @@ def analyze():
     for devctx in devctxs:
         lib.aimdo_analyze(devctx)
 
+def set_vram_pool_limit(bytes, device=None):
+    """High-water mark for recycled physical VRAM pages kept ready for reuse.
+    0 disables recycling. Applies to every initialized device unless one is given.
+    """
+    if lib is None:
+        return
+    for devctx in devctxs if device is None else [get_devctx(device)]:
+        lib.set_vram_pool_limit(devctx, int(bytes))
+
+def set_vbar_orphan_cache_limit(bytes, device=None):
+    """VRAM to keep holding the keyed pages of freed VBARs so a new VBAR with
+    the same content keys can adopt them. 0 (the default) disables the cache.
+    """
+    if lib is None:
+        return
+    for devctx in devctxs if device is None else [get_devctx(device)]:
+        lib.set_vbar_orphan_cache_limit(devctx, int(bytes))
+
+def set_vram_reserve(bytes, device=None):
+    """Keep this much VRAM free ahead of demand with a background thread that
+    evicts VBAR pages, so faults and allocations rarely have to. 0 (the
+    default) stops the thread.
+    """
+    if lib is None:
+        return
+    for devctx in devctxs if device is None else [get_devctx(device)]:
+        if not lib.set_vram_reserve(devctx, int(bytes)):
+            raise RuntimeError("Could not start the VRAM reclaimer thread")
+
+VBAR_POLICY_PRIORITY = 0
+VBAR_POLICY_RECENCY = 1
+VBAR_POLICY_COST = 2
+VBAR_POLICY_FAIRSHARE = 3
+
+def set_vbar_eviction_policy(policy, device=None):
+    """Select how VBAR pages are chosen for eviction under VRAM pressure.
+    PRIORITY truncates the lowest priority VBAR from the top, RECENCY evicts the
+    least recently faulted page and COST evicts the page cheapest to bring back.
+    FAIRSHARE truncates whichever VBAR holds the most beyond its weighted share
+    (ModelVBAR.set_weight()), for concurrent jobs on one GPU.
+    """
+    if lib is None:
+        return
+    for devctx in devctxs if device is None else [get_devctx(device)]:
+        if not lib.vbars_set_policy(devctx, int(policy)):
+            raise ValueError(f"Unknown VBAR eviction policy {policy}")
+
 def get_total_vram_usage():
     if lib is None:
         return 0
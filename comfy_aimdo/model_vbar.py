@@ -1,18 +1,55 @@
+import collections
 import ctypes
+import hashlib
+import os
+import struct
+import threading
+import weakref
 
 from . import control
 
 lib = control.lib
 
+if os.name == "nt":
+    import msvcrt
+
+# struct VbarEvictEvent
+class VbarEvictEvent(ctypes.Structure):
+    _fields_ = [
+        ("vbar", ctypes.c_uint64),
+        ("offset", ctypes.c_uint64),
+        ("size", ctypes.c_uint64),
+        ("serial", ctypes.c_uint64),
+        ("reason", ctypes.c_uint32),
+        ("pad", ctypes.c_uint32),
+    ]
+
+# struct VbarPlan
+class VbarPlan(ctypes.Structure):
+    _fields_ = [
+        ("page_size", ctypes.c_uint64),
+        ("nr_pages", ctypes.c_uint64),
+        ("watermark", ctypes.c_uint64),
+        ("watermark_limit", ctypes.c_uint64),
+    ]
+
 # Bindings
 if lib is not None:
-    lib.vbar_allocate.argtypes = [ctypes.c_void_p, ctypes.c_uint64, ctypes.c_int]
+    lib.vbar_allocate.argtypes = [ctypes.c_void_p, ctypes.c_uint64, ctypes.c_int, ctypes.c_uint64]
     lib.vbar_allocate.restype = ctypes.c_void_p
 
     lib.vbar_set_watermark_limit.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64]
 
     lib.vbar_set_watermark.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64]
 
+    lib.vbar_set_reservation.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64]
+    lib.vbar_set_reservation.restype = ctypes.c_bool
+
+    lib.vbar_set_weight.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint32]
+
+    lib.vbar_set_reload_bw.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64,
+                                       ctypes.c_uint64]
+
     lib.vbars_reset_watermark_limits.argtypes = [ctypes.c_void_p]
 
     lib.vbar_prioritize.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
@@ -27,7 +64,82 @@ if lib is not None:
     lib.vbar_fault.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64, ctypes.POINTER(ctypes.c_uint32)]
     lib.vbar_fault.restype = ctypes.c_int
 
-    lib.vbar_unpin.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64]
+    lib.vbar_fault_partial.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64,
+                                       ctypes.POINTER(ctypes.c_uint32), ctypes.POINTER(ctypes.c_uint64)]
+    lib.vbar_fault_partial.restype = ctypes.c_int
+
+    lib.vbar_fault_host.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64,
+                                    ctypes.POINTER(ctypes.c_uint32)]
+    lib.vbar_fault_host.restype = ctypes.c_int
+
+    lib.vbar_share.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_void_p,
+                               ctypes.c_uint64, ctypes.c_uint64, ctypes.POINTER(ctypes.c_uint32)]
+    lib.vbar_share.restype = ctypes.c_int
+
+    lib.vbar_grow.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64]
+    lib.vbar_grow.restype = ctypes.c_bool
+
+    lib.vbar_clone.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+    lib.vbar_clone.restype = ctypes.c_void_p
+
+    lib.vbar_fault_write.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64,
+                                     ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint32)]
+    lib.vbar_fault_write.restype = ctypes.c_int
+
+    lib.vbar_set_host_fallback.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64]
+    lib.vbar_set_host_fallback.restype = ctypes.c_bool
+
+    lib.vbar_prefetch.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64,
+                                  ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint32)]
+    lib.vbar_prefetch.restype = ctypes.c_int
+
+    lib.vbar_attach_file.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64,
+                                     ctypes.c_uint64, ctypes.c_uint64]
+    lib.vbar_attach_file.restype = ctypes.c_bool
+
+    lib.vbar_attach_host.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64,
+                                     ctypes.c_void_p]
+    lib.vbar_attach_host.restype = ctypes.c_bool
+
+    lib.vbar_set_key.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64,
+                                 ctypes.c_uint64]
+    lib.vbar_set_key.restype = ctypes.c_bool
+
+    lib.vbar_attach_writeback.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64,
+                                          ctypes.c_void_p]
+    lib.vbar_attach_writeback.restype = ctypes.c_bool
+
+    lib.vbar_mark_dirty.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64,
+                                    ctypes.c_void_p]
+
+    lib.vbar_forget_writeback.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64]
+
+    lib.vbar_detach.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64]
+    lib.vbar_detach.restype = ctypes.c_bool
+
+    lib.vbar_fault_populate.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64,
+                                        ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint32)]
+    lib.vbar_fault_populate.restype = ctypes.c_int
+
+    lib.vbar_populate_wait.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]
+
+    lib.vbar_fault_many.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint64),
+                                    ctypes.POINTER(ctypes.c_uint64), ctypes.c_size_t,
+                                    ctypes.POINTER(ctypes.POINTER(ctypes.c_uint32)), ctypes.POINTER(ctypes.c_int)]
+
+    lib.vbar_unpin.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64,
+                               ctypes.c_void_p]
+
+    lib.vbar_unpin_many.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint64),
+                                    ctypes.POINTER(ctypes.c_uint64), ctypes.c_size_t, ctypes.c_void_p]
+
+    lib.vbar_graph_lock.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_void_p),
+                                    ctypes.POINTER(ctypes.c_uint64), ctypes.POINTER(ctypes.c_uint64),
+                                    ctypes.c_size_t]
+    lib.vbar_graph_lock.restype = ctypes.c_void_p
+
+    lib.vbar_graph_unlock.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]
+    lib.vbar_graph_unlock.restype = None
 
     lib.vbar_loaded_size.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
     lib.vbar_loaded_size.restype = ctypes.c_size_t
@@ -38,6 +150,9 @@ if lib is not None:
     lib.vbars_analyze.argtypes = [ctypes.c_void_p, ctypes.c_bool]
     lib.vbars_analyze.restype = ctypes.c_uint64
 
+    lib.vbar_get_page_size.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+    lib.vbar_get_page_size.restype = ctypes.c_size_t
+
     lib.vbar_get_nr_pages.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
     lib.vbar_get_nr_pages.restype = ctypes.c_size_t
 
@@ -46,16 +161,52 @@ if lib is not None:
 
     lib.vbar_get_residency.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint8), ctypes.c_size_t]
 
+    lib.vbar_events_enable.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+    lib.vbar_events_enable.restype = ctypes.c_bool
+
+    lib.vbar_events_drain.argtypes = [ctypes.c_void_p, ctypes.POINTER(VbarEvictEvent), ctypes.c_size_t,
+                                      ctypes.POINTER(ctypes.c_uint64)]
+    lib.vbar_events_drain.restype = ctypes.c_size_t
+
+    lib.vbar_plan_export.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.POINTER(VbarPlan),
+                                     ctypes.POINTER(ctypes.c_uint64), ctypes.c_size_t]
+    lib.vbar_plan_export.restype = ctypes.c_bool
+
+    lib.vbar_plan_import.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.POINTER(VbarPlan),
+                                     ctypes.POINTER(ctypes.c_uint64), ctypes.c_void_p,
+                                     ctypes.POINTER(ctypes.c_uint64)]
+    lib.vbar_plan_import.restype = ctypes.c_bool
+
+def _stream_handle(stream, device):
+    """The raw handle to pass for stream, a torch stream or a raw handle. None
+    is torch's current stream on device, so fences cover work queued there; 0
+    is the legacy default stream.
+    """
+    if stream is None:
+        try:
+            import torch
+        except ImportError:
+            return None
+        stream = torch.cuda.current_stream(device)
+    return int(getattr(stream, "cuda_stream", stream) or 0) or None
+
+# Live VBARs by (devctx, pointer), to map eviction events back to them
+_vbars = weakref.WeakValueDictionary()
+
 class ModelVBAR:
-    def __init__(self, size, device):
+    # page_size=0 uses the library default (32MB). Otherwise it must be a
+    # multiple of the driver allocation granularity (usually 2MB), up to 128MB.
+    def __init__(self, size, device, page_size=0):
         self._devctx = control.get_devctx(device)
-        self._ptr = lib.vbar_allocate(self._devctx, int(size), device)
+        self._ptr = lib.vbar_allocate(self._devctx, int(size), device, int(page_size))
         if not self._ptr:
             raise MemoryError("VBAR allocation failed")
         self.device = device
         self.max_size = size
+        self.page_size = lib.vbar_get_page_size(self._devctx, self._ptr)
         self.offset = 0
         self.base_addr = lib.vbar_get(self._devctx, self._ptr)
+        _vbars[(self._devctx, self._ptr)] = self
 
     def prioritize(self):
         lib.vbar_prioritize(self._devctx, self._ptr)
@@ -63,6 +214,16 @@ class ModelVBAR:
     def deprioritize(self):
         lib.vbar_deprioritize(self._devctx, self._ptr)
 
+    def grow(self, size):
+        """Extend the VBAR to size bytes in place, keeping its address and
+        allocations. Returns False if the address space right after it is
+        taken; reserve a bigger VBAR up front in that case.
+        """
+        if not lib.vbar_grow(self._devctx, self._ptr, int(size)):
+            return False
+        self.max_size = max(self.max_size, size)
+        return True
+
     def alloc(self, num_bytes):
         self.offset = (self.offset + 511) & ~511
 
@@ -73,16 +234,22 @@ class ModelVBAR:
         self.offset += num_bytes
         return (self, alloc, num_bytes)
 
-    #define VBAR_PAGE_SIZE (32 << 20)
-
     #define VBAR_FAULT_SUCCESS      0
     #define VBAR_FAULT_OOM          1
     #define VBAR_FAULT_ERROR        2
 
+    def _signature_buffer(self, size):
+        # +2, one for misalignment and one for rounding
+        return (ctypes.c_uint32 * (size // self.page_size + 2))()
+
+    def _ranges(self, ranges):
+        offsets = (ctypes.c_uint64 * len(ranges))(*(alloc - self.base_addr for alloc, _ in ranges))
+        sizes = (ctypes.c_uint64 * len(ranges))(*(size for _, size in ranges))
+        return offsets, sizes
+
     def fault(self, alloc, size):
         offset = alloc - self.base_addr
-        # +2, one for misalignment and one for rounding
-        signature = (ctypes.c_uint32 * (size // (32 * 1024 ** 2) + 2))()
+        signature = self._signature_buffer(size)
         res = lib.vbar_fault(self._devctx, self._ptr, offset, size, signature)
         if res == 0:
             return signature
@@ -91,9 +258,230 @@ class ModelVBAR:
         else:
             raise RuntimeError(f"Fault failed: {res}")
 
-    def unpin(self, alloc, size):
+    # Fault as many leading pages as fit. Returns (signature, resident_bytes) with
+    # [alloc, alloc + resident_bytes) pinned, or (None, 0). Unpin only the
+    # resident part; the rest is for the caller to stream from host.
+    def fault_partial(self, alloc, size):
+        offset = alloc - self.base_addr
+        signature = self._signature_buffer(size)
+        resident = ctypes.c_uint64(0)
+        res = lib.vbar_fault_partial(self._devctx, self._ptr, offset, size, signature,
+                                     ctypes.byref(resident))
+        if res == 0:
+            return signature, resident.value
+        elif res == 1:
+            return None, 0
+        else:
+            raise RuntimeError(f"Fault failed: {res}")
+
+    # fault() for a range that did not fit in VRAM: pages without VRAM are backed
+    # by pinned host memory at the same addresses and read over the bus in place.
+    # Needs set_host_fallback(). Unpin as for fault(). Host pages keep their
+    # contents between iterations, so the signature only changes when they move.
+    def fault_host(self, alloc, size):
+        offset = alloc - self.base_addr
+        signature = self._signature_buffer(size)
+        res = lib.vbar_fault_host(self._devctx, self._ptr, offset, size, signature)
+        if res == 0:
+            return signature
+        elif res == 1:
+            return None
+        else:
+            raise RuntimeError(f"Host fault failed: {res}")
+
+    # Map the resident pages of src_alloc (in another VBAR holding the same
+    # weights) read-only at alloc instead of loading a second copy. Returns a
+    # signature as for fault() that matches src's, so nothing needs populating,
+    # or None if some pages could not be shared. The weight must not be written.
+    def share_from(self, alloc, src_alloc, size):
+        src, src_addr, _ = src_alloc
+        signature = self._signature_buffer(size)
+        res = lib.vbar_share(self._devctx, self._ptr, alloc - self.base_addr, src._ptr,
+                             src_addr - src.base_addr, int(size), signature)
+        if res == 0:
+            return signature
+        elif res == 1:
+            return None
+        else:
+            raise RuntimeError(f"Share failed: {res}")
+
+    def clone(self):
+        """A new VBAR with this one's layout and sources whose resident pages
+        are read-only mappings of this one's, for an overlay (e.g. a LoRA) that
+        changes only some weights. Write to it only through fault_write().
+        Use translate() to find a weight's alloc in the clone.
+        """
+        ptr = lib.vbar_clone(self._devctx, self._ptr)
+        if not ptr:
+            raise MemoryError("VBAR clone failed")
+        vbar = ModelVBAR.__new__(ModelVBAR)
+        vbar._devctx = self._devctx
+        vbar._ptr = ptr
+        vbar.device = self.device
+        vbar.max_size = self.max_size
+        vbar.page_size = self.page_size
+        vbar.offset = self.offset
+        vbar.base_addr = lib.vbar_get(self._devctx, ptr)
+        _vbars[(vbar._devctx, ptr)] = vbar
+        return vbar
+
+    def translate(self, alloc):
+        """The alloc in this VBAR at the same offset as alloc in another, e.g.
+        the base of a clone().
+        """
+        vbar, addr, size = alloc
+        return (self, self.base_addr + (addr - vbar.base_addr), size)
+
+    # fault() for a range about to be written on stream. Pages still shared with
+    # the VBAR this was cloned from get a private copy first, queued on stream.
+    # The signature changes with the copy, as after any new page.
+    def fault_write(self, alloc, size, stream=None):
+        offset = alloc - self.base_addr
+        signature = self._signature_buffer(size)
+        res = lib.vbar_fault_write(self._devctx, self._ptr, offset, int(size), _stream_handle(stream, self.device),
+                                   signature)
+        if res == 0:
+            return signature
+        elif res == 1:
+            return None
+        else:
+            raise RuntimeError(f"Write fault failed: {res}")
+
+    def set_host_fallback(self, max_bytes):
+        """Allow up to max_bytes of this VBAR to be served from pinned host
+        memory by fault_host(). 0 disables it. Returns False if the driver
+        cannot map host memory into the VBAR.
+        """
+        return bool(lib.vbar_set_host_fallback(self._devctx, self._ptr, int(max_bytes)))
+
+    # Fault ahead of use without pinning. Returns a signature as for fault(); a
+    # changed signature needs its populate queued on stream, and eviction of the
+    # pages before their fault() waits on that stream.
+    def prefetch(self, alloc, size, stream=None):
+        offset = alloc - self.base_addr
+        signature = self._signature_buffer(size)
+        res = lib.vbar_prefetch(self._devctx, self._ptr, offset, size, _stream_handle(stream, self.device),
+                                signature)
+        if res == 0:
+            return signature
+        elif res == 1:
+            return None
+        else:
+            raise RuntimeError(f"Prefetch failed: {res}")
+
+    def attach_file(self, alloc, size, source, file_offset):
+        """Back [alloc, alloc + size) with file contents so fault_populate() and
+        prefetch() can populate it. source is a ModelMMAP, a file object or a
+        raw fd / HANDLE.
+        """
+        if hasattr(source, "get_file_handle"):
+            handle = source.get_file_handle()
+        elif isinstance(source, int):
+            handle = source
+        else:
+            fd = source.fileno()
+            handle = msvcrt.get_osfhandle(fd) if os.name == "nt" else fd
+        if not lib.vbar_attach_file(self._devctx, self._ptr, alloc - self.base_addr, int(size),
+                                    int(handle), int(file_offset)):
+            raise RuntimeError("VBAR attach_file failed")
+
+    def attach_host(self, alloc, size, source, source_offset=0):
+        """Back [alloc, alloc + size) with host memory, a HostBuffer or a raw
+        pointer. It must outlive the attachment.
+        """
+        ptr = source.get_raw_address() if hasattr(source, "get_raw_address") else int(source)
+        if not lib.vbar_attach_host(self._devctx, self._ptr, alloc - self.base_addr, int(size),
+                                    ptr + int(source_offset)):
+            raise RuntimeError("VBAR attach_host failed")
+
+    def set_key(self, alloc, size, key):
+        """Name the contents of [alloc, alloc + size) so its pages can be kept
+        in the orphan cache when this VBAR is freed and adopted by a later VBAR
+        with the same keys (see control.set_vbar_orphan_cache_limit()). key is
+        a non-zero int or anything content_key() accepts.
+        """
+        if not isinstance(key, int):
+            key = content_key(*key) if isinstance(key, tuple) else content_key(key)
+        if not lib.vbar_set_key(self._devctx, self._ptr, alloc - self.base_addr, int(size), key):
+            raise RuntimeError("VBAR set_key failed")
+
+    def attach_writeback(self, alloc, size, dest, dest_offset=0):
+        """Save modified pages of [alloc, alloc + size) to host memory when they
+        are evicted, and restore them from there. dest is a HostBuffer or a raw
+        pointer to page-locked memory that outlives the VBAR.
+        """
+        ptr = dest.get_raw_address() if hasattr(dest, "get_raw_address") else int(dest)
+        if not lib.vbar_attach_writeback(self._devctx, self._ptr, alloc - self.base_addr, int(size),
+                                         ptr + int(dest_offset)):
+            raise RuntimeError("VBAR attach_writeback failed")
+
+    # The weight was modified on the GPU on stream after its populate (LoRA merge,
+    # rescale, patch). Eviction saves it to the write-back region and the next
+    # fault_populate() or prefetch() restores it instead of repopulating.
+    def mark_dirty(self, alloc, size, stream=None):
+        lib.vbar_mark_dirty(self._devctx, self._ptr, alloc - self.base_addr, int(size),
+                            _stream_handle(stream, self.device))
+
+    def forget_writeback(self, alloc, size):
+        lib.vbar_forget_writeback(self._devctx, self._ptr, alloc - self.base_addr, int(size))
+
+    def detach(self, alloc):
+        return bool(lib.vbar_detach(self._devctx, self._ptr, alloc - self.base_addr))
+
+    # fault() that populates missing pages from the attached sources on stream.
+    # stream is also ordered after copies other streams queued for the same
+    # pages, so the weight is ready to use on stream.
+    def fault_populate(self, alloc, size, stream=None):
+        offset = alloc - self.base_addr
+        signature = self._signature_buffer(size)
+        res = lib.vbar_fault_populate(self._devctx, self._ptr, offset, size, _stream_handle(stream, self.device),
+                                      signature)
+        if res == 0:
+            return signature
+        elif res == 1:
+            return None
+        else:
+            raise RuntimeError(f"Fault failed: {res}")
+
+    # Order stream after every populate of the VBAR that may still be in flight,
+    # e.g. prefetches on a side stream ahead of a plain fault().
+    def wait_populate(self, stream=None):
+        lib.vbar_populate_wait(self._devctx, self._ptr, _stream_handle(stream, self.device))
+
+    def fault_many(self, ranges):
+        """Fault a list of (alloc, size) ranges in one call.
+        Returns a list with a signature per range, or None where fault() would
+        have returned None.
+        """
+        n = len(ranges)
+        offsets, sizes = self._ranges(ranges)
+        signatures = [self._signature_buffer(size) for _, size in ranges]
+        signature_ptrs = (ctypes.POINTER(ctypes.c_uint32) * n)(
+            *(ctypes.cast(signature, ctypes.POINTER(ctypes.c_uint32)) for signature in signatures))
+        results = (ctypes.c_int * n)()
+        lib.vbar_fault_many(self._devctx, self._ptr, offsets, sizes, n, signature_ptrs, results)
+
+        out = []
+        for signature, res in zip(signatures, results):
+            if res == 0:
+                out.append(signature)
+            elif res == 1:
+                out.append(None)
+            else:
+                raise RuntimeError(f"Fault failed: {res}")
+        return out
+
+    # stream is the last stream to use the weight, a torch stream or its raw
+    # handle. None is torch's current stream and 0 the legacy default stream.
+    # Eviction of the pages waits only on that stream's work up to this point.
+    def unpin(self, alloc, size, stream=None):
         offset = alloc - self.base_addr
-        lib.vbar_unpin(self._devctx, self._ptr, offset, size)
+        lib.vbar_unpin(self._devctx, self._ptr, offset, size, _stream_handle(stream, self.device))
+
+    def unpin_many(self, ranges, stream=None):
+        offsets, sizes = self._ranges(ranges)
+        lib.vbar_unpin_many(self._devctx, self._ptr, offsets, sizes, len(ranges),
+                            _stream_handle(stream, self.device))
 
     def loaded_size(self):
         return lib.vbar_loaded_size(self._devctx, self._ptr)
@@ -101,6 +489,28 @@ class ModelVBAR:
     def set_watermark_limit(self, size_bytes):
         lib.vbar_set_watermark_limit(self._devctx, self._ptr, size_bytes)
 
+    # Keep at least size_bytes of this VBAR resident against eviction for
+    # anything else. False if all reservations would not fit in VRAM.
+    def set_reservation(self, size_bytes):
+        return lib.vbar_set_reservation(self._devctx, self._ptr, int(size_bytes))
+
+    def set_weight(self, weight):
+        """This VBAR's share of VRAM relative to others under the FAIRSHARE
+        eviction policy (see control.set_vbar_eviction_policy()). Default 1.
+        """
+        lib.vbar_set_weight(self._devctx, self._ptr, max(int(weight), 1))
+
+    def set_reload_bandwidth(self, bytes_per_sec, alloc=None, size=0):
+        """How fast evicted pages come back, in bytes/sec of their source: high
+        for a pinned HostBuffer, low for a network filesystem. For the whole
+        VBAR, or for [alloc, alloc + size) where that differs. Eviction prefers
+        pages that are cheap to reload. 0 restores the default (1 GB/s).
+        """
+        offset = 0 if alloc is None else alloc - self.base_addr
+        if alloc is not None and not size:
+            raise ValueError("A range needs a size")
+        lib.vbar_set_reload_bw(self._devctx, self._ptr, offset, int(size), int(bytes_per_sec))
+
     def set_watermark(self, size_bytes):
         lib.vbar_set_watermark(self._devctx, self._ptr, size_bytes)
 
@@ -117,12 +527,46 @@ class ModelVBAR:
         """Returns a list of per-page status flags.
         Bit 0 (& 1): resident in VRAM
         Bit 1 (& 2): pinned
+        Bit 2 (& 4): prefetched, not yet faulted
+        Bit 3 (& 8): held by a graph lock
+        Bit 4 (& 16): backed by host memory (fault_host())
         """
         nr_pages = self.get_nr_pages()
         buf = (ctypes.c_uint8 * nr_pages)()
         lib.vbar_get_residency(self._devctx, self._ptr, buf, nr_pages)
         return list(buf)
 
+    def export_plan(self):
+        """The VBAR's steady state (watermarks and resident pages) as bytes for
+        import_plan() in a later process.
+        """
+        words = (self.get_nr_pages() + 63) // 64
+        plan = VbarPlan()
+        resident = (ctypes.c_uint64 * words)()
+        if not lib.vbar_plan_export(self._devctx, self._ptr, ctypes.byref(plan), resident, words):
+            raise RuntimeError("VBAR plan export failed")
+        return struct.pack(f"<4Q{words}Q", plan.page_size, plan.nr_pages, plan.watermark,
+                           plan.watermark_limit, *resident)
+
+    def import_plan(self, data, stream=None):
+        """Warm start from export_plan() bytes of a VBAR with the same size and
+        page size: restores the watermarks and faults the pages that were
+        resident, as far as VRAM allows without evicting. Faulted pages are
+        prefetched on stream, as with prefetch(). Returns the bytes prefaulted,
+        or None if the plan does not fit this VBAR.
+        """
+        page_size, nr_pages, watermark, watermark_limit = struct.unpack_from("<4Q", data)
+        words = (nr_pages + 63) // 64
+        if len(data) != 32 + words * 8:
+            raise ValueError("Truncated VBAR plan")
+        plan = VbarPlan(page_size, nr_pages, watermark, watermark_limit)
+        resident = (ctypes.c_uint64 * words)(*struct.unpack_from(f"<{words}Q", data, 32))
+        prefaulted = ctypes.c_uint64(0)
+        if not lib.vbar_plan_import(self._devctx, self._ptr, ctypes.byref(plan), resident,
+                                    _stream_handle(stream, self.device), ctypes.byref(prefaulted)):
+            return None
+        return prefaulted.value
+
     def __del__(self):
         ptr = getattr(self, "_ptr", None)
         aimdo_lib = getattr(control, "lib", None)
@@ -130,14 +574,182 @@ class ModelVBAR:
             aimdo_lib.vbar_free(self._devctx, ptr)
             self._ptr = None
 
+def content_key(*parts):
+    """A 64-bit content key from e.g. (file path, mtime, offset, length)."""
+    digest = hashlib.blake2b(repr(parts).encode(), digest_size=8).digest()
+    return int.from_bytes(digest, "little") or 1
+
 def vbar_fault(alloc):
     vbar, offset, size = alloc
     return vbar.fault(offset, size)
 
-def vbar_unpin(alloc):
+def vbar_fault_partial(alloc):
+    vbar, offset, size = alloc
+    return vbar.fault_partial(offset, size)
+
+def vbar_fault_host(alloc):
+    vbar, offset, size = alloc
+    return vbar.fault_host(offset, size)
+
+def vbar_share(alloc, src_alloc):
+    """Back alloc with the VRAM of src_alloc, an alloc of the same weight in
+    another VBAR. See ModelVBAR.share_from().
+    """
+    vbar, offset, size = alloc
+    return vbar.share_from(offset, src_alloc, size)
+
+def vbar_fault_write(alloc, stream=None):
+    vbar, offset, size = alloc
+    return vbar.fault_write(offset, size, stream)
+
+def vbar_fault_populate(alloc, stream=None):
+    vbar, offset, size = alloc
+    return vbar.fault_populate(offset, size, stream)
+
+def vbar_prefetch(alloc, stream=None):
+    vbar, offset, size = alloc
+    return vbar.prefetch(offset, size, stream)
+
+def vbar_unpin(alloc, stream=None):
     if alloc is not None:
         vbar, offset, size = alloc
-        vbar.unpin(offset, size)
+        vbar.unpin(offset, size, stream)
+
+def vbar_fault_many(allocs):
+    """Fault a list of allocs that all live in the same VBAR."""
+    if not allocs:
+        return []
+    vbar = allocs[0][0]
+    return vbar.fault_many([(offset, size) for _, offset, size in allocs])
+
+def vbar_unpin_many(allocs, stream=None):
+    allocs = [alloc for alloc in allocs if alloc is not None]
+    if allocs:
+        vbar = allocs[0][0]
+        vbar.unpin_many([(offset, size) for _, offset, size in allocs], stream)
+
+class VbarGraphLock:
+    """Holds allocs resident at fixed addresses for CUDA graph replay. Release
+    when the graph is destroyed, and before freeing any of the VBARs.
+    """
+    def __init__(self, allocs):
+        allocs = [alloc for alloc in allocs if alloc is not None]
+        if not allocs:
+            raise ValueError("Nothing to lock")
+        devctx = allocs[0][0]._devctx
+        vbars = (ctypes.c_void_p * len(allocs))(*(vbar._ptr for vbar, _, _ in allocs))
+        offsets = (ctypes.c_uint64 * len(allocs))(*(offset - vbar.base_addr for vbar, offset, _ in allocs))
+        sizes = (ctypes.c_uint64 * len(allocs))(*(size for _, _, size in allocs))
+        self._devctx = devctx
+        self.device = allocs[0][0].device
+        # The VBARs must outlive the lock
+        self._vbars = [vbar for vbar, _, _ in allocs]
+        self._token = lib.vbar_graph_lock(devctx, vbars, offsets, sizes, len(allocs))
+        if not self._token:
+            raise MemoryError("Could not make the graph working set resident")
+
+    # stream is the last stream the graph was replayed on. Eviction of the
+    # released pages waits on its work up to this point.
+    def release(self, stream=None):
+        token = getattr(self, "_token", None)
+        if token and control.lib is not None:
+            lib.vbar_graph_unlock(self._devctx, token, _stream_handle(stream, self.device))
+        self._token = None
+        self._vbars = None
+
+    def __del__(self):
+        self.release()
+
+def vbar_graph_lock(allocs):
+    """Allocs of one device to hold for a captured graph. See VbarGraphLock."""
+    return VbarGraphLock(allocs)
+
+# enum VbarEvictReason
+EVICT_FAULT = 0      # Making room for a fault of another VBAR
+EVICT_ALLOCATOR = 1  # Allocations outside the VBARs
+EVICT_WATERMARK = 2  # set_watermark() or free_memory()
+EVICT_RECLAIM = 3    # The background reclaimer, see control.set_vram_reserve()
+
+# addr and size are in the same terms as an alloc. vbar is None once freed.
+EvictionEvent = collections.namedtuple("EvictionEvent", ["vbar", "addr", "size", "serial", "reason"])
+
+_events_lock = threading.Lock()
+
+def enable_eviction_events(capacity=0, device=None):
+    """Start recording evicted page ranges for drain_eviction_events(). capacity
+    is how many can queue up between drains (0 for the default of 4096); more
+    are dropped and counted.
+    """
+    if lib is None:
+        return
+    for devctx in control.devctxs if device is None else [control.get_devctx(device)]:
+        if not lib.vbar_events_enable(devctx, int(capacity)):
+            raise MemoryError("Could not allocate the eviction event ring")
+
+def drain_eviction_events(device=None, max_events=1024):
+    """Returns (events, dropped): EvictionEvents oldest first, and how many were
+    lost to a full ring so far. Any alloc overlapping an event will fault with
+    a changed signature.
+    """
+    if lib is None or not control.devctxs:
+        return [], 0
+
+    devctx = control.devctxs[0] if device is None else control.get_devctx(device)
+    buf = (VbarEvictEvent * max_events)()
+    dropped = ctypes.c_uint64(0)
+    with _events_lock:
+        n = lib.vbar_events_drain(devctx, buf, max_events, ctypes.byref(dropped))
+
+    events = []
+    for ev in buf[:n]:
+        vbar = _vbars.get((devctx, ev.vbar))
+        addr = vbar.base_addr + ev.offset if vbar is not None else None
+        events.append(EvictionEvent(vbar, addr, ev.size, ev.serial, ev.reason))
+    return events, dropped.value
+
+_PLAN_MAGIC = b"AIMDOPLN"
+_PLAN_VERSION = 1
+
+def save_residency_plan(path, vbars):
+    """Write the steady state of each VBAR in vbars, a dict of stable name
+    (e.g. model path) -> ModelVBAR, to path.
+    """
+    with open(path, "wb") as f:
+        f.write(_PLAN_MAGIC + struct.pack("<II", _PLAN_VERSION, len(vbars)))
+        for name, vbar in vbars.items():
+            key = name.encode()
+            plan = vbar.export_plan()
+            f.write(struct.pack("<HI", len(key), len(plan)) + key + plan)
+
+def load_residency_plan(path, vbars, stream=None):
+    """Warm start the VBARs in vbars (as for save_residency_plan()) from the
+    plans in path, in dict order, so the VBARs that matter most go first as
+    nothing is evicted for a plan. Names without
+    a plan, or whose VBAR changed shape, start cold. Returns a dict of name ->
+    bytes prefaulted.
+    """
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[:8] != _PLAN_MAGIC:
+        raise ValueError(f"{path} is not a VBAR residency plan")
+    version, count = struct.unpack_from("<II", data, 8)
+    if version != _PLAN_VERSION:
+        raise ValueError(f"Unsupported VBAR residency plan version {version}")
+
+    plans = {}
+    pos = 16
+    for _ in range(count):
+        key_len, plan_len = struct.unpack_from("<HI", data, pos)
+        pos += 6
+        name = data[pos:pos + key_len].decode()
+        plans[name] = data[pos + key_len:pos + key_len + plan_len]
+        pos += key_len + plan_len
+
+    prefaulted = {}
+    for name, vbar in vbars.items():
+        if name in plans:
+            prefaulted[name] = vbar.import_plan(plans[name], stream) or 0
+    return prefaulted
 
 def vbar_signature_compare(a, b):
     if a is None or b is None:
@@ -45,7 +45,7 @@ def run_layer(input_tensor, weight, cpu_source, weight_offset): #NOTE: offset ju
     output = input_tensor + w
 
     if weight is not None:
-        vbar_unpin(weight)
+        vbar_unpin(weight, torch.cuda.current_stream())
 
     return output
 
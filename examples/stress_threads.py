@@ -0,0 +1,112 @@
+import sys
+import time
+import threading
+
+#Several threads faulting and unpinning their own VBARs. Reports faults per second.
+#Then the contended case: a loader thread prefetching into one VBAR while a compute
+#thread faults, populates, checks and unpins the same weights.
+#usage: python stress_threads.py [threads] [seconds]
+
+import comfy_aimdo.control
+comfy_aimdo.control.init()
+comfy_aimdo.control.set_log_info()
+
+import torch
+import comfy_aimdo.torch
+from comfy_aimdo.host_buffer import HostBuffer
+from comfy_aimdo.model_vbar import ModelVBAR, vbar_fault, vbar_unpin, vbar_prefetch, vbar_fault_populate
+
+comfy_aimdo.control.init_device(torch.device(torch.cuda.current_device()).index)
+
+M = (1024 ** 2)
+
+num_threads = int(sys.argv[1]) if len(sys.argv) > 1 else 4
+seconds = float(sys.argv[2]) if len(sys.argv) > 2 else 10
+
+gpu_size = torch.cuda.get_device_properties(torch.cuda.current_device()).total_memory
+
+#Every thread gets a model of 30 weights. Together they are 1.5X VRAM, so there are
+#misses and evictions between threads as well as hits.
+num_layers = 30
+weight_size = gpu_size * 3 // (2 * num_threads * num_layers)
+
+vbars = [ModelVBAR(gpu_size * 2, device=0) for _ in range(num_threads)]
+weights = [[vbar.alloc(weight_size) for _ in range(num_layers)] for vbar in vbars]
+counts = [[0, 0] for _ in range(num_threads)] #hits, offloads
+stop = threading.Event()
+
+def worker(i):
+    while not stop.is_set():
+        for weight in weights[i]:
+            if vbar_fault(weight) is not None:
+                counts[i][0] += 1
+                vbar_unpin(weight)
+            else:
+                counts[i][1] += 1
+
+threads = [threading.Thread(target=worker, args=(i,)) for i in range(num_threads)]
+start = time.time()
+for t in threads:
+    t.start()
+time.sleep(seconds)
+stop.set()
+for t in threads:
+    t.join()
+elapsed = time.time() - start
+
+for i, (faulted, offloaded) in enumerate(counts):
+    print(f"thread {i}: {faulted} faulted, {offloaded} offloaded, {vbars[i].loaded_size() // M}M loaded")
+total = sum(faulted + offloaded for faulted, offloaded in counts)
+print(f"{num_threads} threads: {total / elapsed:.0f} faults/s")
+
+#The VBARs above stay loaded, so the shared model is under pressure too. Weight j
+#is filled with j % 251 + 1 on the host so a bad populate shows up as a bad read.
+shared_size = gpu_size // 2
+shared_weight_size = shared_size // num_layers
+shared_vbar = ModelVBAR(gpu_size, device=0)
+shared_weights = [shared_vbar.alloc(shared_weight_size) for _ in range(num_layers)]
+host = HostBuffer(shared_size)
+host_tensor = comfy_aimdo.torch.hostbuf_to_tensor(host)
+for j, weight in enumerate(shared_weights):
+    host_tensor[j * shared_weight_size:(j + 1) * shared_weight_size].fill_(j % 251 + 1)
+    shared_vbar.attach_host(weight[1], shared_weight_size, host, j * shared_weight_size)
+
+shared_counts = [0, 0, 0, 0] #hits, offloads, prefetches, bad reads
+stop.clear()
+
+def loader():
+    stream = torch.cuda.Stream()
+    while not stop.is_set():
+        for weight in shared_weights:
+            vbar_prefetch(weight, stream)
+            shared_counts[2] += 1
+
+def compute():
+    stream = torch.cuda.Stream()
+    with torch.cuda.stream(stream):
+        while not stop.is_set():
+            for j, weight in enumerate(shared_weights):
+                if vbar_fault_populate(weight, stream) is None:
+                    shared_counts[1] += 1
+                    continue
+                shared_counts[0] += 1
+                #No extra wait, fault_populate() must have ordered stream itself
+                ends = comfy_aimdo.torch.aimdo_to_tensor(weight, torch.device("cuda:0"))[[0, -1]]
+                if ends.tolist() != [j % 251 + 1] * 2:
+                    shared_counts[3] += 1
+                vbar_unpin(weight, stream)
+
+threads = [threading.Thread(target=loader), threading.Thread(target=compute)]
+start = time.time()
+for t in threads:
+    t.start()
+time.sleep(seconds)
+stop.set()
+for t in threads:
+    t.join()
+elapsed = time.time() - start
+
+hits, offloads, prefetches, bad = shared_counts
+print(f"contended: {hits} faulted, {offloads} offloaded, {prefetches} prefetched, {bad} bad reads, "
+      f"{(hits + offloads) / elapsed:.0f} faults/s")
+comfy_aimdo.control.analyze() #print some stats
@@ -33,7 +33,10 @@ static const DispatchSymbol dispatch_symbols[] = {
     { (void **)&g_cuda.p_cuGetErrorString, "hipDrvGetErrorString" },
     { (void **)&g_cuda.p_cuCtxGetDevice, "hipGetDevice" },
     { (void **)&g_cuda.p_cuCtxSynchronize, "hipDeviceSynchronize" },
+    { (void **)&g_cuda.p_cuCtxSetCurrent, "hipCtxSetCurrent" },
     { (void **)&g_cuda.p_cuDeviceGet, "hipDeviceGet" },
+    { (void **)&g_cuda.p_cuDevicePrimaryCtxRetain, "hipDevicePrimaryCtxRetain" },
+    { (void **)&g_cuda.p_cuDevicePrimaryCtxRelease, "hipDevicePrimaryCtxRelease" },
     { (void **)&g_cuda.p_cuDeviceTotalMem, "hipDeviceTotalMem" },
     { (void **)&g_cuda.p_cuDeviceGetName, "hipDeviceGetName" },
     { (void **)&g_cuda.p_cuMemGetInfo, "hipMemGetInfo" },
@@ -50,13 +53,18 @@ static const DispatchSymbol dispatch_symbols[] = {
     { (void **)&g_cuda.p_cuMemCreate, "hipMemCreate" },
     { (void **)&g_cuda.p_cuMemMap, "hipMemMap" },
     { (void **)&g_cuda.p_cuMemSetAccess, "hipMemSetAccess" },
+    { (void **)&g_cuda.p_cuMemGetAllocationGranularity, "hipMemGetAllocationGranularity" },
     { (void **)&g_cuda.p_cuMemUnmap, "hipMemUnmap" },
     { (void **)&g_cuda.p_cuMemRelease, "hipMemRelease" },
     { (void **)&g_cuda.p_cuMemcpyHtoDAsync, "hipMemcpyHtoDAsync" },
+    { (void **)&g_cuda.p_cuMemcpyDtoHAsync, "hipMemcpyDtoHAsync" },
+    { (void **)&g_cuda.p_cuMemcpyDtoDAsync, "hipMemcpyDtoDAsync" },
     { (void **)&g_cuda.p_cuEventCreate, "hipEventCreateWithFlags" },
     { (void **)&g_cuda.p_cuEventDestroy, "hipEventDestroy" },
     { (void **)&g_cuda.p_cuEventRecord, "hipEventRecord" },
     { (void **)&g_cuda.p_cuEventSynchronize, "hipEventSynchronize" },
+    { (void **)&g_cuda.p_cuEventQuery, "hipEventQuery" },
+    { (void **)&g_cuda.p_cuStreamWaitEvent, "hipStreamWaitEvent" },
 };
 
 static const char *const hip_library_names[] = {
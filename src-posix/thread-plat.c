@@ -1,6 +1,8 @@
 #include "thread-plat.h"
 
+#include <errno.h>
 #include <stdlib.h>
+#include <time.h>
 
 Mutex mutex_create(void) {
     pthread_mutex_t *mutex = malloc(sizeof(*mutex));
@@ -30,6 +32,42 @@ void mutex_destroy(Mutex mutex) {
     free(mutex);
 }
 
+RwLock rwlock_create(void) {
+    pthread_rwlock_t *rwlock = malloc(sizeof(*rwlock));
+
+    if (rwlock && pthread_rwlock_init(rwlock, NULL) == 0) {
+        return rwlock;
+    }
+
+    free(rwlock);
+    return NULL;
+}
+
+void rwlock_read_lock(RwLock rwlock) {
+    pthread_rwlock_rdlock(rwlock);
+}
+
+void rwlock_read_unlock(RwLock rwlock) {
+    pthread_rwlock_unlock(rwlock);
+}
+
+void rwlock_write_lock(RwLock rwlock) {
+    pthread_rwlock_wrlock(rwlock);
+}
+
+void rwlock_write_unlock(RwLock rwlock) {
+    pthread_rwlock_unlock(rwlock);
+}
+
+void rwlock_destroy(RwLock rwlock) {
+    if (!rwlock) {
+        return;
+    }
+
+    pthread_rwlock_destroy(rwlock);
+    free(rwlock);
+}
+
 CondVar condvar_create(void) {
     pthread_cond_t *condvar = malloc(sizeof(*condvar));
 
@@ -45,6 +83,19 @@ void condvar_wait(CondVar condvar, Mutex mutex) {
     pthread_cond_wait(condvar, mutex);
 }
 
+bool condvar_wait_timeout(CondVar condvar, Mutex mutex, unsigned int timeout_ms) {
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return pthread_cond_timedwait(condvar, mutex, &deadline) != ETIMEDOUT;
+}
+
 void condvar_signal(CondVar condvar) {
     pthread_cond_signal(condvar);
 }
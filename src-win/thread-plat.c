@@ -30,6 +30,37 @@ void mutex_destroy(Mutex mutex) {
     free(mutex);
 }
 
+RwLock rwlock_create(void) {
+    SRWLOCK *rwlock = malloc(sizeof(*rwlock));
+
+    if (!rwlock) {
+        return NULL;
+    }
+
+    InitializeSRWLock(rwlock);
+    return rwlock;
+}
+
+void rwlock_read_lock(RwLock rwlock) {
+    AcquireSRWLockShared(rwlock);
+}
+
+void rwlock_read_unlock(RwLock rwlock) {
+    ReleaseSRWLockShared(rwlock);
+}
+
+void rwlock_write_lock(RwLock rwlock) {
+    AcquireSRWLockExclusive(rwlock);
+}
+
+void rwlock_write_unlock(RwLock rwlock) {
+    ReleaseSRWLockExclusive(rwlock);
+}
+
+void rwlock_destroy(RwLock rwlock) {
+    free(rwlock);
+}
+
 CondVar condvar_create(void) {
     CONDITION_VARIABLE *condvar = malloc(sizeof(*condvar));
 
@@ -45,6 +76,10 @@ void condvar_wait(CondVar condvar, Mutex mutex) {
     SleepConditionVariableCS(condvar, mutex, INFINITE);
 }
 
+bool condvar_wait_timeout(CondVar condvar, Mutex mutex, unsigned int timeout_ms) {
+    return SleepConditionVariableCS(condvar, mutex, timeout_ms) || GetLastError() != ERROR_TIMEOUT;
+}
+
 void condvar_signal(CondVar condvar) {
     WakeConditionVariable(condvar);
 }
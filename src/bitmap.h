@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+/* Flat uint64_t bitmaps. The find helpers search [start, end) a word at a time
+ * and return end (SIZE_MAX for bitmap_find_last) when there is no match.
+ */
+
+#define BITMAP_WORDS(nr_bits) (((nr_bits) + 63) / 64)
+
+static inline unsigned bit_first(uint64_t w) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long i;
+    _BitScanForward64(&i, w);
+    return (unsigned)i;
+#else
+    return (unsigned)__builtin_ctzll(w);
+#endif
+}
+
+static inline unsigned bit_last(uint64_t w) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long i;
+    _BitScanReverse64(&i, w);
+    return (unsigned)i;
+#else
+    return 63 - (unsigned)__builtin_clzll(w);
+#endif
+}
+
+static inline void bitmap_set(uint64_t *map, size_t bit) {
+    map[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static inline void bitmap_clear(uint64_t *map, size_t bit) {
+    map[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+static inline bool bitmap_test(const uint64_t *map, size_t bit) {
+    return (map[bit / 64] >> (bit % 64)) & 1;
+}
+
+/* The bits of word that fall inside [start, end), word starting at base */
+static inline uint64_t bitmap_window(uint64_t word, size_t base, size_t start, size_t end) {
+    if (start > base) {
+        word &= ~0ULL << (start - base);
+    }
+    if (end - base < 64) {
+        word &= (1ULL << (end - base)) - 1;
+    }
+    return word;
+}
+
+static inline size_t bitmap_find_next(const uint64_t *map, size_t start, size_t end) {
+    while (start < end) {
+        size_t base = start & ~(size_t)63;
+        uint64_t w = bitmap_window(map[base / 64], base, start, end);
+
+        if (w) {
+            return base + bit_first(w);
+        }
+        start = base + 64;
+    }
+    return end;
+}
+
+static inline size_t bitmap_find_next_clear(const uint64_t *map, size_t start, size_t end) {
+    while (start < end) {
+        size_t base = start & ~(size_t)63;
+        uint64_t w = bitmap_window(~map[base / 64], base, start, end);
+
+        if (w) {
+            return base + bit_first(w);
+        }
+        start = base + 64;
+    }
+    return end;
+}
+
+static inline size_t bitmap_find_last(const uint64_t *map, size_t start, size_t end) {
+    while (end > start) {
+        size_t base = (end - 1) & ~(size_t)63;
+        uint64_t w = bitmap_window(map[base / 64], base, start, end);
+
+        if (w) {
+            return base + bit_last(w);
+        }
+        end = base;
+    }
+    return SIZE_MAX;
+}
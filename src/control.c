@@ -1,6 +1,7 @@
 #include "plat.h"
 #include "aimdo-time.h"
 #include "xfer-file.h"
+#include "thread-plat.h"
 
 #if !defined(_WIN32) && !defined(_WIN64) && !defined(__HIP_PLATFORM_AMD__)
 #define INTEGRATED_RAM_HEADROOM_MIN (2ULL * G)
@@ -57,6 +58,23 @@ static AimdoContext *g_all_devctxs;
 static size_t g_all_devctx_count;
 
 void hostbuf_file_reader_cleanup(void);
+bool hostbuf_file_reader_init(void);
+
+static size_t query_alloc_granularity(int device) {
+    CUmemAllocationProp prop = {
+        .type = CU_MEM_ALLOCATION_TYPE_PINNED,
+        .location.type = CU_MEM_LOCATION_TYPE_DEVICE,
+        .location.id = device,
+    };
+    size_t granularity = 0;
+
+    if (!CHECK_CU(cuMemGetAllocationGranularity(&granularity, &prop,
+                                                CU_MEM_ALLOC_GRANULARITY_MINIMUM)) ||
+        !granularity) {
+        return CUDA_PAGE_SIZE;
+    }
+    return granularity;
+}
 
 SHARED_EXPORT
 void set_simple_vram_headroom(int64_t bytes) {
@@ -175,6 +193,13 @@ void aimdo_analyze(void *devctx) {
 
     CHECK_CU(cuMemGetInfo(&free_bytes, &total_bytes));
     log(DEBUG, "  Aimdo Recorded Usage:  %7zu MB\n", total_vram_usage / M);
+    log(DEBUG, "  Recycled Page Pool:    %7zu MB / %7zu MB\n",
+        (size_t)vram_pool_size / M, (size_t)vram_pool_limit / M);
+    log(DEBUG, "  Orphaned VBAR Pages:   %7zu MB / %7zu MB\n",
+        (size_t)vram_orphan_size / M, (size_t)vram_orphan_limit / M);
+    if (vram_reclaimer) {
+        log(DEBUG, "  Background Reserve:    %7zu MB\n", (size_t)vram_reserve / M);
+    }
     log(DEBUG, "  Cuda:  %7zu MB / %7zu MB Free\n", free_bytes / M, total_bytes / M);
 
     vbars_analyze(devctx, true);
@@ -191,11 +216,26 @@ SHARED_EXPORT
 void cleanup(void) {
     for (size_t i = 0; i < g_all_devctx_count; i++) {
         set_devctx(&g_all_devctxs[i]);
+        vram_reclaim_stop();
         hostbuf_file_reader_cleanup();
+        vrampool_trim(SIZE_MAX, 0);
         aimdo_wddm_cleanup();
         allocations_cleanup();
 
         free(highest_priority_p); /* FIXME: move the model_vbar. */
+        free(vbar_events);
+        free(g_devctx->_vbar_heap);
+        if (vbars_lock) {
+            rwlock_destroy((RwLock)vbars_lock);
+        }
+        if (g_devctx->_hostbuf_file_reader_lock) {
+            mutex_destroy((Mutex)g_devctx->_hostbuf_file_reader_lock);
+        }
+        for (unsigned r = 0; r < HOSTBUF_FILE_READER_STREAMS; r++) {
+            if (g_devctx->_hostbuf_file_readers[r].lock) {
+                mutex_destroy((Mutex)g_devctx->_hostbuf_file_readers[r].lock);
+            }
+        }
     }
 
     free(g_all_devctxs);
@@ -221,16 +261,21 @@ bool init(const int *cuda_device_ids, const uint64_t *extra_vram_headrooms, size
 
         devctx->_device_id = cuda_device_ids[i];
         devctx->_extra_vram_headroom = extra_vram_headrooms[i];
-        devctx->_hostbuf_file_reader_active = -1;
+        devctx->_vram_pool_limit = VRAM_POOL_LIMIT;
         set_devctx(devctx);
 
-        if (!allocations_init() ||
+        if (!(devctx->_vbars_lock = rwlock_create()) ||
+            !(devctx->_hostbuf_file_reader_lock = mutex_create()) ||
+            !hostbuf_file_reader_init() ||
+            !allocations_init() ||
             !CHECK_CU(cuDeviceGet(&dev, cuda_device_ids[i])) ||
             !CHECK_CU(cuDeviceTotalMem(&vram_capacity, dev)) ||
             !aimdo_wddm_init(dev)) {
             goto fail;
         }
 
+        devctx->_alloc_granularity = query_alloc_granularity(cuda_device_ids[i]);
+
 #if !defined(_WIN32) && !defined(_WIN64) && !defined(__HIP_PLATFORM_AMD__)
         devctx->_integrated_device = is_integrated_cuda_device(dev);
         if (devctx->_integrated_device) {
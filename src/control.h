@@ -13,9 +13,11 @@
 #define VMM_HASH_SIZE   (1 << 12)
 #define SIZE_HASH_SIZE  1024
 #define HOSTBUF_FILE_READER_SLOTS 3
+#define HOSTBUF_FILE_READER_STREAMS 4
 
 typedef struct VramBuffer VramBuffer;
 typedef struct SizeEntry SizeEntry;
+typedef struct VramPoolEntry VramPoolEntry;
 typedef struct ModelVBAR ModelVBAR;
 
 typedef struct HostbufFileReaderSlot {
@@ -25,10 +27,23 @@ typedef struct HostbufFileReaderSlot {
     CUevent event;
 } HostbufFileReaderSlot;
 
+/* The windows of one stream. Reads on other streams neither wait behind its
+ * file I/O nor retire its windows.
+ */
+typedef struct HostbufFileReader {
+    HostbufFileReaderSlot slots[HOSTBUF_FILE_READER_SLOTS];
+    int active;
+    CUstream stream;
+    bool used;
+    uint64_t last_use;
+    void *lock; /* Mutex, held across the reads */
+} HostbufFileReader;
+
 typedef struct AimdoContext {
     int _device_id;
 
     uint64_t _vram_capacity;
+    uint64_t _alloc_granularity;
     uint64_t _integrated_ram_headroom;
     uint64_t _extra_vram_headroom;
     uint64_t _total_vram_usage;
@@ -37,14 +52,35 @@ typedef struct AimdoContext {
     uint64_t _control_timestamp_last_check;
     void *_highest_priority; /* ModelVBAR * */
     void *_lowest_priority; /* ModelVBAR * */
+    int _vbar_policy_id;
+    uint64_t _vbar_clock;
+    uint64_t _vbar_inflation;
+    void *_vbar_heap; /* VbarHeapEntry *, see model-vbar-policy.c */
+    size_t _vbar_heap_len;
+    size_t _vbar_heap_cap;
+    size_t _vbar_heap_pages; /* Pages of all VBARs, which bounds the heap */
+    size_t _vbar_serial;
+    uint64_t _vbar_reserved;
+    void *_vbars_lock; /* RwLock */
+    void *_vbar_events; /* VbarEventRing * */
+    void *_vbar_graph_locks; /* VbarGraphLock *, live tokens */
     bool _vbars_dirty;
     bool _allocations_dirty;
     bool _integrated_device;
     VramBuffer *_vmm_table[VMM_HASH_SIZE];
     SizeEntry *_size_table[SIZE_HASH_SIZE];
     void *_size_table_lock;
-    HostbufFileReaderSlot _hostbuf_file_reader_slots[HOSTBUF_FILE_READER_SLOTS];
-    int _hostbuf_file_reader_active;
+    VramPoolEntry *_vram_pool;
+    uint64_t _vram_pool_size;
+    uint64_t _vram_pool_limit;
+    VramPoolEntry *_vram_orphans;
+    uint64_t _vram_orphan_size;
+    uint64_t _vram_orphan_limit;
+    void *_vram_reclaimer; /* VramReclaimer * */
+    uint64_t _vram_reserve;
+    HostbufFileReader _hostbuf_file_readers[HOSTBUF_FILE_READER_STREAMS];
+    uint64_t _hostbuf_file_reader_clock;
+    void *_hostbuf_file_reader_lock; /* Mutex, for handing out readers */
 #if defined(__HIP_PLATFORM_AMD__) && defined(_WIN32)
     VramBuffer *_va_pool;
 #endif
@@ -64,6 +100,7 @@ bool set_devctx_for_device(int device_id);
 bool set_devctx_for_current_cuda_device(void);
 
 #define vram_capacity               (g_devctx->_vram_capacity)
+#define alloc_granularity           (g_devctx->_alloc_granularity)
 #define integrated_ram_headroom     (g_devctx->_integrated_ram_headroom)
 #define extra_vram_headroom         (g_devctx->_extra_vram_headroom)
 #define total_vram_usage            (g_devctx->_total_vram_usage)
@@ -71,12 +108,32 @@ bool set_devctx_for_current_cuda_device(void);
 #define deficit_sync                (g_devctx->_deficit_sync)
 #define highest_priority_p          (*(ModelVBAR **)&g_devctx->_highest_priority)
 #define lowest_priority_p           (*(ModelVBAR **)&g_devctx->_lowest_priority)
+#define vbar_policy_id              (g_devctx->_vbar_policy_id)
+#define vbar_clock                  (g_devctx->_vbar_clock)
+#define vbar_inflation              (g_devctx->_vbar_inflation)
+#define vbar_heap_p                 (*(VbarHeapEntry **)&g_devctx->_vbar_heap)
+#define vbar_heap_len               (g_devctx->_vbar_heap_len)
+#define vbar_heap_cap               (g_devctx->_vbar_heap_cap)
+#define vbar_heap_pages             (g_devctx->_vbar_heap_pages)
+#define vbar_serial                 (g_devctx->_vbar_serial)
+#define vbar_reserved               (g_devctx->_vbar_reserved)
+#define vbars_lock                  (g_devctx->_vbars_lock)
+#define vbar_events                 (g_devctx->_vbar_events)
+#define vbar_graph_locks            (g_devctx->_vbar_graph_locks)
 #define vbars_dirty                 (g_devctx->_vbars_dirty)
 #define allocations_dirty           (g_devctx->_allocations_dirty)
 #define integrated_device           (g_devctx->_integrated_device)
 #define vmm_table                   (g_devctx->_vmm_table)
 #define size_table                  (g_devctx->_size_table)
 #define size_table_lock             (g_devctx->_size_table_lock)
+#define vram_pool                   (g_devctx->_vram_pool)
+#define vram_pool_size              (g_devctx->_vram_pool_size)
+#define vram_pool_limit             (g_devctx->_vram_pool_limit)
+#define vram_orphans                (g_devctx->_vram_orphans)
+#define vram_orphan_size            (g_devctx->_vram_orphan_size)
+#define vram_orphan_limit           (g_devctx->_vram_orphan_limit)
+#define vram_reclaimer              (g_devctx->_vram_reclaimer)
+#define vram_reserve                (g_devctx->_vram_reserve)
 #if defined(__HIP_PLATFORM_AMD__) && defined(_WIN32)
 #define va_pool                     (g_devctx->_va_pool)
 #endif
@@ -11,7 +11,10 @@ typedef CUresult (CUDAAPI *PFN_cuGetProcAddress)(const char *symbol, void **pfn,
 typedef CUresult (CUDAAPI *PFN_cuGetErrorString)(CUresult error, const char **pStr);
 typedef CUresult (CUDAAPI *PFN_cuCtxGetDevice)(CUdevice *device);
 typedef CUresult (CUDAAPI *PFN_cuCtxSynchronize)(void);
+typedef CUresult (CUDAAPI *PFN_cuCtxSetCurrent)(CUcontext ctx);
 typedef CUresult (CUDAAPI *PFN_cuDeviceGet)(CUdevice *device, int ordinal);
+typedef CUresult (CUDAAPI *PFN_cuDevicePrimaryCtxRetain)(CUcontext *pctx, CUdevice dev);
+typedef CUresult (CUDAAPI *PFN_cuDevicePrimaryCtxRelease)(CUdevice dev);
 typedef CUresult (CUDAAPI *PFN_cuDeviceGetAttribute)(int *pi, CUdevice_attribute attrib,
                                                      CUdevice dev);
 typedef CUresult (CUDAAPI *PFN_cuDeviceTotalMem)(size_t *bytes, CUdevice dev);
@@ -39,14 +42,23 @@ typedef CUresult (CUDAAPI *PFN_cuMemMap)(CUdeviceptr ptr, size_t size, size_t of
                                          unsigned long long flags);
 typedef CUresult (CUDAAPI *PFN_cuMemSetAccess)(CUdeviceptr ptr, size_t size,
                                                const CUmemAccessDesc *desc, size_t count);
+typedef CUresult (CUDAAPI *PFN_cuMemGetAllocationGranularity)(
+    size_t *granularity, const CUmemAllocationProp *prop, CUmemAllocationGranularity_flags option);
 typedef CUresult (CUDAAPI *PFN_cuMemUnmap)(CUdeviceptr ptr, size_t size);
 typedef CUresult (CUDAAPI *PFN_cuMemRelease)(CUmemGenericAllocationHandle handle);
 typedef CUresult (CUDAAPI *PFN_cuMemcpyHtoDAsync)(CUdeviceptr dst, const void *src,
                                                   size_t bytes, CUstream hStream);
+typedef CUresult (CUDAAPI *PFN_cuMemcpyDtoHAsync)(void *dst, CUdeviceptr src,
+                                                  size_t bytes, CUstream hStream);
+typedef CUresult (CUDAAPI *PFN_cuMemcpyDtoDAsync)(CUdeviceptr dst, CUdeviceptr src,
+                                                  size_t bytes, CUstream hStream);
 typedef CUresult (CUDAAPI *PFN_cuEventCreate)(CUevent *phEvent, unsigned int flags);
 typedef CUresult (CUDAAPI *PFN_cuEventDestroy)(CUevent hEvent);
 typedef CUresult (CUDAAPI *PFN_cuEventRecord)(CUevent hEvent, CUstream hStream);
 typedef CUresult (CUDAAPI *PFN_cuEventSynchronize)(CUevent hEvent);
+typedef CUresult (CUDAAPI *PFN_cuEventQuery)(CUevent hEvent);
+typedef CUresult (CUDAAPI *PFN_cuStreamWaitEvent)(CUstream hStream, CUevent hEvent,
+                                                  unsigned int flags);
 typedef CUresult (CUDAAPI *PFN_cuDeviceGetLuid)(char *luid, unsigned int *deviceNodeMask,
                                                 CUdevice dev);
 
@@ -56,7 +68,10 @@ typedef struct AimdoCudaDispatch {
     PFN_cuGetErrorString p_cuGetErrorString;
     PFN_cuCtxGetDevice p_cuCtxGetDevice;
     PFN_cuCtxSynchronize p_cuCtxSynchronize;
+    PFN_cuCtxSetCurrent p_cuCtxSetCurrent;
     PFN_cuDeviceGet p_cuDeviceGet;
+    PFN_cuDevicePrimaryCtxRetain p_cuDevicePrimaryCtxRetain;
+    PFN_cuDevicePrimaryCtxRelease p_cuDevicePrimaryCtxRelease;
     PFN_cuDeviceGetAttribute p_cuDeviceGetAttribute;
     PFN_cuDeviceTotalMem p_cuDeviceTotalMem;
     PFN_cuDeviceGetName p_cuDeviceGetName;
@@ -76,13 +91,18 @@ typedef struct AimdoCudaDispatch {
     PFN_cuMemCreate p_cuMemCreate;
     PFN_cuMemMap p_cuMemMap;
     PFN_cuMemSetAccess p_cuMemSetAccess;
+    PFN_cuMemGetAllocationGranularity p_cuMemGetAllocationGranularity;
     PFN_cuMemUnmap p_cuMemUnmap;
     PFN_cuMemRelease p_cuMemRelease;
     PFN_cuMemcpyHtoDAsync p_cuMemcpyHtoDAsync;
+    PFN_cuMemcpyDtoHAsync p_cuMemcpyDtoHAsync;
+    PFN_cuMemcpyDtoDAsync p_cuMemcpyDtoDAsync;
     PFN_cuEventCreate p_cuEventCreate;
     PFN_cuEventDestroy p_cuEventDestroy;
     PFN_cuEventRecord p_cuEventRecord;
     PFN_cuEventSynchronize p_cuEventSynchronize;
+    PFN_cuEventQuery p_cuEventQuery;
+    PFN_cuStreamWaitEvent p_cuStreamWaitEvent;
     PFN_cuDeviceGetLuid p_cuDeviceGetLuid;
 } AimdoCudaDispatch;
 
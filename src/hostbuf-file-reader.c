@@ -1,29 +1,29 @@
 #include "plat.h"
 #include "xfer-file.h"
+#include "thread-plat.h"
 
 #define HOSTBUF_FILE_READER_WINDOW (64ULL * 1024ULL * 1024ULL)
 #define LEAD_IN_THRESHOLD (HOSTBUF_FILE_READER_WINDOW - 16ULL * 1024ULL * 1024ULL)
 
-static bool hostbuf_file_reader_retire_active(void) {
+static bool hostbuf_file_reader_retire_active(HostbufFileReader *reader) {
     HostbufFileReaderSlot *slot;
 
-    if (g_devctx->_hostbuf_file_reader_active < 0) {
+    if (reader->active < 0) {
         return true;
     }
 
-    slot = &g_devctx->_hostbuf_file_reader_slots[g_devctx->_hostbuf_file_reader_active];
+    slot = &reader->slots[reader->active];
     return !slot->offset ||
            (!slot->event &&
            CHECK_CU(cuEventCreate(&slot->event, CU_EVENT_DISABLE_TIMING)) &&
            CHECK_CU(cuEventRecord(slot->event, (CUstream)slot->stream)));
 }
 
-static HostbufFileReaderSlot *hostbuf_file_reader_next(cudaStream_t stream) {
+static HostbufFileReaderSlot *hostbuf_file_reader_next(HostbufFileReader *reader, cudaStream_t stream) {
     HostbufFileReaderSlot *slot;
 
-    g_devctx->_hostbuf_file_reader_active =
-        (g_devctx->_hostbuf_file_reader_active + 1) % HOSTBUF_FILE_READER_SLOTS;
-    slot = &g_devctx->_hostbuf_file_reader_slots[g_devctx->_hostbuf_file_reader_active];
+    reader->active = (reader->active + 1) % HOSTBUF_FILE_READER_SLOTS;
+    slot = &reader->slots[reader->active];
 
     if (slot->buffer && slot->event) {
         if (!CHECK_CU(cuEventSynchronize(slot->event)) ||
@@ -43,10 +43,65 @@ static HostbufFileReaderSlot *hostbuf_file_reader_next(cudaStream_t stream) {
     return slot;
 }
 
+bool hostbuf_file_reader_init(void) {
+    for (unsigned i = 0; i < HOSTBUF_FILE_READER_STREAMS; i++) {
+        g_devctx->_hostbuf_file_readers[i].active = -1;
+        if (!(g_devctx->_hostbuf_file_readers[i].lock = mutex_create())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* The reader of stream, locked. A stream without one takes a free reader, or
+ * the least recently used one once there are more streams than readers.
+ */
+static HostbufFileReader *hostbuf_file_reader_get(cudaStream_t stream) {
+    HostbufFileReader *readers = g_devctx->_hostbuf_file_readers;
+    HostbufFileReader *reader = NULL;
+
+    mutex_lock((Mutex)g_devctx->_hostbuf_file_reader_lock);
+    for (unsigned i = 0; i < HOSTBUF_FILE_READER_STREAMS && !reader; i++) {
+        if (readers[i].used && readers[i].stream == (CUstream)stream) {
+            reader = &readers[i];
+        }
+    }
+    for (unsigned i = 0; i < HOSTBUF_FILE_READER_STREAMS && !reader; i++) {
+        if (!readers[i].used) {
+            reader = &readers[i];
+        }
+    }
+    if (!reader) {
+        reader = &readers[0];
+        for (unsigned i = 1; i < HOSTBUF_FILE_READER_STREAMS; i++) {
+            if (readers[i].last_use < reader->last_use) {
+                reader = &readers[i];
+            }
+        }
+    }
+    reader->used = true;
+    reader->stream = (CUstream)stream;
+    reader->last_use = ++g_devctx->_hostbuf_file_reader_clock;
+    mutex_unlock((Mutex)g_devctx->_hostbuf_file_reader_lock);
+
+    /* It may have been handed to another stream meanwhile. The windows track
+     * their own stream, so that only costs a window.
+     */
+    mutex_lock((Mutex)reader->lock);
+    return reader;
+}
+
+/* Each stream reading into the device gets its own windows, be it a VBAR
+ * populate or the application directly. Threads on different streams read
+ * in parallel, threads on the same stream take turns.
+ */
 SHARED_EXPORT
 bool hostbuf_file_reader_read(int device, uint64_t file_handle, uint64_t file_offset,
                               uint64_t size, cudaStream_t stream,
                               uint64_t device_ptr, bool mark_cold) {
+    HostbufFileReader *reader;
+    bool ret = false;
+
     if (size == 0) {
         return true;
     }
@@ -54,17 +109,17 @@ bool hostbuf_file_reader_read(int device, uint64_t file_handle, uint64_t file_of
         return false;
     }
 
+    reader = hostbuf_file_reader_get(stream);
     while (size) {
-        HostbufFileReaderSlot *slot = g_devctx->_hostbuf_file_reader_active < 0 ? NULL :
-            &g_devctx->_hostbuf_file_reader_slots[g_devctx->_hostbuf_file_reader_active];
+        HostbufFileReaderSlot *slot = reader->active < 0 ? NULL : &reader->slots[reader->active];
         size_t chunk;
 
         if (!slot || slot->stream != (CUstream)stream ||
             (slot->offset + size >= HOSTBUF_FILE_READER_WINDOW &&
              slot->offset >= LEAD_IN_THRESHOLD)) {
-            if (!hostbuf_file_reader_retire_active() ||
-                !(slot = hostbuf_file_reader_next(stream))) {
-                return false;
+            if (!hostbuf_file_reader_retire_active(reader) ||
+                !(slot = hostbuf_file_reader_next(reader, stream))) {
+                goto out;
             }
         }
 
@@ -74,7 +129,7 @@ bool hostbuf_file_reader_read(int device, uint64_t file_handle, uint64_t file_of
             !CHECK_CU(cuMemcpyHtoDAsync((CUdeviceptr)device_ptr,
                                         slot->buffer + slot->offset,
                                         chunk, (CUstream)stream))) {
-            return false;
+            goto out;
         }
 
         slot->offset += chunk;
@@ -82,29 +137,43 @@ bool hostbuf_file_reader_read(int device, uint64_t file_handle, uint64_t file_of
         device_ptr += chunk;
         size -= chunk;
     }
+    ret = true;
 
-    return true;
+out:
+    mutex_unlock((Mutex)reader->lock);
+    return ret;
 }
 
 SHARED_EXPORT
 void hostbuf_file_reader_cleanup(void) {
-    if (!g_devctx) {
+    if (!g_devctx || !g_devctx->_hostbuf_file_reader_lock) {
         return;
     }
 
-    hostbuf_file_reader_retire_active();
-    for (unsigned i = 0; i < HOSTBUF_FILE_READER_SLOTS; i++) {
-        HostbufFileReaderSlot *slot = &g_devctx->_hostbuf_file_reader_slots[i];
+    mutex_lock((Mutex)g_devctx->_hostbuf_file_reader_lock);
+    for (unsigned r = 0; r < HOSTBUF_FILE_READER_STREAMS; r++) {
+        HostbufFileReader *reader = &g_devctx->_hostbuf_file_readers[r];
 
-        if (slot->buffer && slot->event) {
-            CHECK_CU(cuEventSynchronize(slot->event));
-            CHECK_CU(cuEventDestroy(slot->event));
+        if (!reader->lock) {
+            continue;
         }
-        if (slot->buffer) {
-            CHECK_CU(cuMemFreeHost(slot->buffer));
+        mutex_lock((Mutex)reader->lock);
+        hostbuf_file_reader_retire_active(reader);
+        for (unsigned i = 0; i < HOSTBUF_FILE_READER_SLOTS; i++) {
+            HostbufFileReaderSlot *slot = &reader->slots[i];
+
+            if (slot->buffer && slot->event) {
+                CHECK_CU(cuEventSynchronize(slot->event));
+                CHECK_CU(cuEventDestroy(slot->event));
+            }
+            if (slot->buffer) {
+                CHECK_CU(cuMemFreeHost(slot->buffer));
+            }
         }
+        memset(reader->slots, 0, sizeof(reader->slots));
+        reader->active = -1;
+        reader->used = false;
+        mutex_unlock((Mutex)reader->lock);
     }
-    memset(g_devctx->_hostbuf_file_reader_slots, 0,
-           sizeof(g_devctx->_hostbuf_file_reader_slots));
-    g_devctx->_hostbuf_file_reader_active = -1;
+    mutex_unlock((Mutex)g_devctx->_hostbuf_file_reader_lock);
 }
@@ -0,0 +1,110 @@
+#include "model-vbar.h"
+
+/* Eviction notifications, so the application can plan reloads ahead of its
+ * next fault instead of finding out from a changed signature. Evictions all
+ * happen under the exclusive VBAR lock, which makes the evicting side a single
+ * producer. The application drains from one thread at a time, so head and tail
+ * are the only shared state. When the ring is full, new events are dropped and
+ * counted rather than blocking eviction.
+ */
+
+#define VBAR_EVENTS_DEFAULT 4096
+
+typedef struct VbarEventRing {
+    uint64_t head; /* Written by the evicting side only */
+    uint64_t tail; /* Written by the drainer only */
+    uint64_t dropped;
+    uint64_t mask;
+    VbarEvictEvent events[1]; /* Must be last! */
+} VbarEventRing;
+
+void vbar_event_record(ModelVBAR *mv, size_t first, size_t nr_pages, int reason) {
+    VbarEventRing *ring = (VbarEventRing *)vbar_events;
+    VbarEvictEvent *ev;
+    uint64_t head;
+
+    if (!ring || reason == VBAR_EVICT_NONE) {
+        return;
+    }
+
+    head = ring->head;
+    if (head - atomic_load_acquire_u64(&ring->tail) > ring->mask) {
+        atomic_add_u64(&ring->dropped, 1);
+        return;
+    }
+
+    ev = &ring->events[head & ring->mask];
+    ev->vbar = (uint64_t)(uintptr_t)mv;
+    ev->offset = (uint64_t)first * mv->page_size;
+    ev->size = (uint64_t)nr_pages * mv->page_size;
+    ev->serial = mv->residency_map[first].serial;
+    ev->reason = (uint32_t)reason;
+    ev->pad = 0;
+    atomic_store_release_u64(&ring->head, head + 1);
+}
+
+/* Start recording evictions, with room for capacity events (rounded up to a
+ * power of 2, 0 for the default) between drains. The ring lives until
+ * cleanup(), so a second call keeps the existing one.
+ */
+SHARED_EXPORT
+bool vbar_events_enable(void *devctx, uint64_t capacity) {
+    VbarEventRing *ring;
+    uint64_t n = 1;
+
+    set_devctx((AimdoContext *)devctx);
+    if (vbar_events) {
+        return true;
+    }
+
+    capacity = capacity ? capacity : VBAR_EVENTS_DEFAULT;
+    while (n < capacity) {
+        n <<= 1;
+    }
+
+    ring = (VbarEventRing *)calloc(1, sizeof(*ring) + (n - 1) * sizeof(ring->events[0]));
+    if (!ring) {
+        log(ERROR, "%s: out of memory\n", __func__);
+        return false;
+    }
+    ring->mask = n - 1;
+    log(DEBUG, "%s: %llu events\n", __func__, (ull)n);
+
+    vbars_lock_exclusive();
+    vbar_events = ring;
+    vbars_unlock_exclusive();
+    return true;
+}
+
+/* Copy out up to max events, oldest first. *dropped, if given, is the running
+ * count of events lost to a full ring. Not safe to call from several threads
+ * at once.
+ */
+SHARED_EXPORT
+size_t vbar_events_drain(void *devctx, VbarEvictEvent *out, size_t max, uint64_t *dropped) {
+    VbarEventRing *ring;
+    uint64_t head, tail;
+    size_t n;
+
+    set_devctx((AimdoContext *)devctx);
+    ring = (VbarEventRing *)vbar_events;
+    if (!ring) {
+        if (dropped) {
+            *dropped = 0;
+        }
+        return 0;
+    }
+
+    tail = ring->tail;
+    head = atomic_load_acquire_u64(&ring->head);
+    n = (size_t)MIN(head - tail, (uint64_t)max);
+    for (size_t i = 0; i < n; i++) {
+        out[i] = ring->events[(tail + i) & ring->mask];
+    }
+    atomic_store_release_u64(&ring->tail, tail + n);
+
+    if (dropped) {
+        *dropped = atomic_load_acquire_u64(&ring->dropped);
+    }
+    return n;
+}
@@ -0,0 +1,404 @@
+#include "model-vbar.h"
+
+/* Priorities are close enough to trade for reload cost between this many of
+ * the lowest priority VBARs with something to give. One of them goes ahead of
+ * the lowest only if its page reloads VBAR_RELOAD_BW_RATIO times faster.
+ */
+#define VBAR_RELOAD_WINDOW 2
+#define VBAR_RELOAD_BW_RATIO 4
+
+/* The page the priority policy would take from i, or SIZE_MAX. Only looks,
+ * the caller truncates the VBAR it picks.
+ */
+static size_t priority_candidate(ModelVBAR *i, ModelVBAR *protect) {
+    size_t p;
+
+    if (i->watermark <= vbar_watermark_floor(i)) {
+        return SIZE_MAX;
+    }
+    p = i == protect ? i->watermark - 1
+                     : bitmap_find_last(i->resident, vbar_watermark_floor(i), i->watermark);
+    if (p == SIZE_MAX) {
+        return SIZE_MAX;
+    }
+    /* A VBAR down to its reservation keeps its watermark too */
+    if (i != protect && !vbar_over_reservation(i, vbar_run_pages(i, p))) {
+        return SIZE_MAX;
+    }
+    return p;
+}
+
+/* The watermark drops straight to the next resident page, which is where
+ * walking it down page by page would stop. The faulting VBAR still steps one
+ * page at a time, as vbars_free_for_vbar() stops once its own watermark meets
+ * its cursor. Nothing ranked above the faulting VBAR is traded for.
+ */
+static bool priority_next_victim(ModelVBAR *protect, size_t protect_end,
+                                 ModelVBAR **victim, size_t *page_nr) {
+    ModelVBAR *best = NULL;
+    ModelVBAR *lowest = NULL;
+    size_t best_p = 0;
+    uint64_t best_bw = 0;
+    int window = 0;
+
+    for (ModelVBAR *i = lowest_priority.higher; i != &highest_priority && window < VBAR_RELOAD_WINDOW;
+         i = i->higher) {
+        size_t p = priority_candidate(i, protect);
+        uint64_t bw;
+
+        if (p == SIZE_MAX) {
+            continue;
+        }
+        lowest = lowest ? lowest : i;
+        if (i == protect && best) {
+            break;
+        }
+        bw = vbar_page_reload_bw(i, p);
+        if (!best || bw / VBAR_RELOAD_BW_RATIO >= best_bw) {
+            best = i;
+            best_p = p;
+            best_bw = bw;
+        }
+        if (i == protect) {
+            break;
+        }
+        window++;
+    }
+
+    /* Walking the watermarks down from the bottom would have truncated the
+     * empty VBARs below the lowest one with a page to give on the way. VBARs
+     * further up the window, and any down to their reservation, keep theirs.
+     */
+    for (ModelVBAR *i = lowest_priority.higher; i != &highest_priority && i != lowest; i = i->higher) {
+        if (i != protect && i->watermark > vbar_watermark_floor(i) &&
+            bitmap_find_last(i->resident, vbar_watermark_floor(i), i->watermark) == SIZE_MAX) {
+            i->watermark = vbar_watermark_floor(i);
+        }
+    }
+    if (!best) {
+        return false;
+    }
+    *victim = best;
+    *page_nr = best->watermark = best_p;
+    return true;
+}
+
+/* Prefetched pages nobody has used yet go first. Clearing prefetched only
+ * raises the key.
+ */
+static inline uint64_t heap_key(ModelVBAR *mv, size_t page_nr) {
+    ResidentPage *rp = &mv->residency_map[page_nr];
+
+    if (rp->prefetched) {
+        return 0;
+    }
+    return vbar_policy_id == VBAR_POLICY_COST ? rp->credit : rp->last_access;
+}
+
+/* Ties go to the highest page, as with the priority policy */
+static inline bool heap_before(VbarHeapEntry *a, VbarHeapEntry *b) {
+    return a->key < b->key || (a->key == b->key && a->page_nr > b->page_nr);
+}
+
+static inline void heap_put(size_t slot, VbarHeapEntry entry) {
+    vbar_heap_p[slot] = entry;
+    entry.mv->residency_map[entry.page_nr].heap_slot = slot + 1;
+}
+
+static void heap_sift_up(size_t slot) {
+    VbarHeapEntry entry = vbar_heap_p[slot];
+
+    while (slot && heap_before(&entry, &vbar_heap_p[(slot - 1) / 2])) {
+        heap_put(slot, vbar_heap_p[(slot - 1) / 2]);
+        slot = (slot - 1) / 2;
+    }
+    heap_put(slot, entry);
+}
+
+static void heap_sift_down(size_t slot) {
+    VbarHeapEntry entry = vbar_heap_p[slot];
+    size_t child;
+
+    while ((child = slot * 2 + 1) < vbar_heap_len) {
+        if (child + 1 < vbar_heap_len && heap_before(&vbar_heap_p[child + 1], &vbar_heap_p[child])) {
+            child++;
+        }
+        if (!heap_before(&vbar_heap_p[child], &entry)) {
+            break;
+        }
+        heap_put(slot, vbar_heap_p[child]);
+        slot = child;
+    }
+    heap_put(slot, entry);
+}
+
+/* Make room for nr_pages more pages, so that vbar_heap_insert() cannot fail
+ * once they are resident.
+ */
+bool vbar_heap_reserve(size_t nr_pages) {
+    size_t cap = vbar_heap_pages + nr_pages;
+    VbarHeapEntry *heap;
+
+    if (cap > vbar_heap_cap) {
+        cap = MAX(cap, vbar_heap_cap * 2);
+        if (!(heap = (VbarHeapEntry *)realloc(vbar_heap_p, cap * sizeof(*heap)))) {
+            log(CRITICAL, "Host OOM\n");
+            return false;
+        }
+        vbar_heap_p = heap;
+        vbar_heap_cap = cap;
+    }
+    vbar_heap_pages += nr_pages;
+    return true;
+}
+
+void vbar_heap_insert(ModelVBAR *mv, size_t page_nr) {
+    VbarHeapEntry entry = { .mv = mv, .page_nr = page_nr, .key = heap_key(mv, page_nr) };
+
+    if (vbar_heap_len >= vbar_heap_cap) {
+        log(ERROR, "%s: victim heap is full\n", __func__);
+        return;
+    }
+    heap_put(vbar_heap_len++, entry);
+    heap_sift_up(vbar_heap_len - 1);
+}
+
+void vbar_heap_remove(ModelVBAR *mv, size_t page_nr) {
+    ResidentPage *rp = &mv->residency_map[page_nr];
+    size_t slot = rp->heap_slot - 1;
+    VbarHeapEntry last;
+
+    if (!rp->heap_slot) {
+        return;
+    }
+    rp->heap_slot = 0;
+    if (slot == --vbar_heap_len) {
+        return;
+    }
+    last = vbar_heap_p[vbar_heap_len];
+    heap_put(slot, last);
+    heap_sift_up(slot);
+    heap_sift_down(last.mv->residency_map[last.page_nr].heap_slot - 1);
+}
+
+/* Rekey a page whose key may have dropped, under the exclusive lock */
+void vbar_heap_update(ModelVBAR *mv, size_t page_nr) {
+    ResidentPage *rp = &mv->residency_map[page_nr];
+
+    if (!rp->heap_slot) {
+        return;
+    }
+    vbar_heap_p[rp->heap_slot - 1].key = heap_key(mv, page_nr);
+    heap_sift_up(rp->heap_slot - 1);
+    heap_sift_down(rp->heap_slot - 1);
+}
+
+/* Rekey the whole heap, for a change of policy */
+static void heap_rebuild(void) {
+    for (size_t slot = 0; slot < vbar_heap_len; slot++) {
+        vbar_heap_p[slot].key = heap_key(vbar_heap_p[slot].mv, vbar_heap_p[slot].page_nr);
+    }
+    for (size_t slot = vbar_heap_len / 2; slot-- > 0;) {
+        heap_sift_down(slot);
+    }
+}
+
+/* The evictable page with the smallest key. Stale entries catch up on the
+ * way. Pages that cannot go are popped past the end of the heap while looking
+ * and pushed back after, so the cost is in the pages skipped rather than in
+ * everything resident.
+ */
+static bool heap_next_victim(ModelVBAR *protect, size_t protect_end,
+                             ModelVBAR **victim, size_t *page_nr) {
+    size_t len = vbar_heap_len;
+    bool found = false;
+
+    while (vbar_heap_len) {
+        VbarHeapEntry *top = &vbar_heap_p[0];
+        ModelVBAR *i = top->mv;
+        size_t p = top->page_nr;
+        uint64_t key = heap_key(i, p);
+
+        if (key != top->key) {
+            top->key = key;
+            heap_sift_down(0);
+            continue;
+        }
+        if ((p >= i->watermark_limit || i->residency_map[p].prefetched) &&
+            (i != protect || p >= protect_end) && vbar_page_evictable(i, p, protect, protect_end)) {
+            found = true;
+            *victim = i;
+            *page_nr = p;
+            break;
+        }
+        vbar_heap_len--;
+        if (vbar_heap_len) {
+            VbarHeapEntry skipped = *top;
+
+            heap_put(0, vbar_heap_p[vbar_heap_len]);
+            heap_put(vbar_heap_len, skipped);
+            heap_sift_down(0);
+        }
+    }
+    while (vbar_heap_len < len) {
+        heap_sift_up(vbar_heap_len++);
+    }
+    return found;
+}
+
+static bool recency_next_victim(ModelVBAR *protect, size_t protect_end,
+                                ModelVBAR **victim, size_t *page_nr) {
+    return heap_next_victim(protect, protect_end, victim, page_nr);
+}
+
+static bool cost_next_victim(ModelVBAR *protect, size_t protect_end,
+                             ModelVBAR **victim, size_t *page_nr) {
+    if (!heap_next_victim(protect, protect_end, victim, page_nr)) {
+        return false;
+    }
+    /* GreedyDual inflation: everything left is now valued relative to this */
+    vbar_inflation = (*victim)->residency_map[*page_nr].credit;
+    return true;
+}
+
+/* An unused prefetched page, lowest priority VBAR and highest page first.
+ * Walks the prefetched bitmaps, so it costs words rather than resident pages.
+ */
+bool vbar_prefetched_victim(ModelVBAR *protect, size_t protect_end,
+                            ModelVBAR **victim, size_t *page_nr) {
+    for (ModelVBAR *i = lowest_priority.higher; i != &highest_priority; i = i->higher) {
+        if (!i->resident_count) {
+            continue;
+        }
+        for (size_t end = i->nr_pages, p;
+             (p = bitmap_find_last(i->prefetched, 0, end)) != SIZE_MAX; end = p) {
+            ResidentPage *rp = &i->residency_map[p];
+
+            if (!rp->prefetched) {
+                bitmap_clear(i->prefetched, p);
+                continue;
+            }
+            if (rp->handle && (i != protect || p >= protect_end) &&
+                vbar_page_evictable(i, p, protect, protect_end)) {
+                *victim = i;
+                *page_nr = p;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* Milliseconds to bring the page back, at least 1 */
+static inline uint64_t page_reload_cost(ModelVBAR *mv, size_t page_nr) {
+    return MAX((uint64_t)mv->page_size * 1000 / vbar_page_reload_bw(mv, page_nr), 1);
+}
+
+/* Hits run under the shared lock and leave the victim heap alone, so a hit
+ * never lowers the key. A fresh page is touched under the exclusive lock and
+ * resifted right away.
+ */
+void vbar_page_touch(ModelVBAR *mv, ResidentPage *rp, bool fresh) {
+    uint64_t credit;
+
+    rp->hits = fresh ? 1 : rp->hits + 1;
+    rp->last_access = atomic_add_u64(&vbar_clock, 1);
+    credit = vbar_inflation + (uint64_t)rp->hits * page_reload_cost(mv, rp - mv->residency_map);
+    rp->credit = fresh ? credit : MAX(credit, rp->credit);
+    if (fresh) {
+        vbar_heap_update(mv, rp - mv->residency_map);
+    }
+}
+
+/* Evict from the VBAR that holds the most resident memory beyond its weighted
+ * share of what all VBARs with residency (and the faulting one) hold. Ties go to
+ * the lowest priority VBAR.
+ */
+static bool fairshare_next_victim(ModelVBAR *protect, size_t protect_end,
+                                  ModelVBAR **victim, size_t *page_nr) {
+    ModelVBAR *best = NULL;
+    size_t best_p = 0;
+    int64_t best_excess = 0;
+    uint64_t total = 0;
+    uint64_t weights = 0;
+
+    for (ModelVBAR *i = lowest_priority.higher; i != &highest_priority; i = i->higher) {
+        if (i->resident_count || i == protect) {
+            total += (uint64_t)i->resident_count * i->page_size;
+            weights += i->weight;
+        }
+    }
+
+    for (ModelVBAR *i = lowest_priority.higher; i != &highest_priority; i = i->higher) {
+        size_t p;
+        int64_t excess;
+
+        if (!i->resident_count && i != protect) {
+            continue;
+        }
+        if ((p = priority_candidate(i, protect)) == SIZE_MAX) {
+            continue;
+        }
+        /* resident - total * weight / weights, scaled by weights */
+        excess = (int64_t)((uint64_t)i->resident_count * i->page_size / M * weights) -
+                 (int64_t)(total / M * i->weight);
+        if (!best || excess > best_excess) {
+            best = i;
+            best_p = p;
+            best_excess = excess;
+        }
+    }
+    if (!best) {
+        return false;
+    }
+    *victim = best;
+    *page_nr = best->watermark = best_p;
+    return true;
+}
+
+static const VbarPolicy priority_policy = {
+    .name = "priority",
+    .truncates_watermark = true,
+    .next_victim = priority_next_victim,
+};
+
+static const VbarPolicy recency_policy = {
+    .name = "recency",
+    .ranks_prefetched = true,
+    .next_victim = recency_next_victim,
+};
+
+static const VbarPolicy cost_policy = {
+    .name = "cost",
+    .ranks_prefetched = true,
+    .next_victim = cost_next_victim,
+};
+
+static const VbarPolicy fairshare_policy = {
+    .name = "fairshare",
+    .truncates_watermark = true,
+    .next_victim = fairshare_next_victim,
+};
+
+const VbarPolicy *const vbar_policies[VBAR_POLICY_COUNT] = {
+    [VBAR_POLICY_PRIORITY] = &priority_policy,
+    [VBAR_POLICY_RECENCY] = &recency_policy,
+    [VBAR_POLICY_COST] = &cost_policy,
+    [VBAR_POLICY_FAIRSHARE] = &fairshare_policy,
+};
+
+SHARED_EXPORT
+bool vbars_set_policy(void *devctx, int policy) {
+    set_devctx((AimdoContext *)devctx);
+
+    if (policy < 0 || policy >= VBAR_POLICY_COUNT) {
+        log(ERROR, "%s: unknown VBAR eviction policy %d\n", __func__, policy);
+        return false;
+    }
+    log(DEBUG, "%s: %s\n", __func__, vbar_policies[policy]->name);
+    vbars_lock_exclusive();
+    vbar_policy_id = policy;
+    heap_rebuild();
+    vbars_unlock_exclusive();
+    return true;
+}
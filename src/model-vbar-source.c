@@ -0,0 +1,359 @@
+#include "model-vbar.h"
+
+/* Index of the first range in the sorted list that ends after offset */
+static size_t range_find(const VbarSource *list, size_t nr, uint64_t offset) {
+    size_t lo = 0;
+    size_t hi = nr;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (list[mid].offset + list[mid].size <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static bool range_insert(ModelVBAR *mv, VbarSource **list, size_t *nr, size_t *cap,
+                         VbarSource *src) {
+    size_t i = range_find(*list, *nr, src->offset);
+
+    if (!src->size || src->offset + src->size > (uint64_t)mv->nr_pages * mv->page_size) {
+        log(ERROR, "%s: range %llx+%llx outside VBAR\n", __func__, (ull)src->offset, (ull)src->size);
+        return false;
+    }
+    if (i < *nr && (*list)[i].offset < src->offset + src->size) {
+        log(ERROR, "%s: range %llx+%llx overlaps an attached range\n", __func__,
+            (ull)src->offset, (ull)src->size);
+        return false;
+    }
+
+    if (*nr == *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 64;
+        VbarSource *grown = (VbarSource *)realloc(*list, new_cap * sizeof(*grown));
+
+        if (!grown) {
+            log(ERROR, "%s: out of memory\n", __func__);
+            return false;
+        }
+        *list = grown;
+        *cap = new_cap;
+    }
+
+    memmove(&(*list)[i + 1], &(*list)[i], (*nr - i) * sizeof(*src));
+    (*list)[i] = *src;
+    (*nr)++;
+    return true;
+}
+
+static inline size_t source_find(ModelVBAR *mv, uint64_t offset) {
+    return range_find(mv->sources, mv->nr_sources, offset);
+}
+
+static inline bool source_insert(ModelVBAR *mv, VbarSource *src) {
+    return range_insert(mv, &mv->sources, &mv->nr_sources, &mv->sources_cap, src);
+}
+
+static bool source_insert_locked(ModelVBAR *mv, VbarSource *src) {
+    bool ret;
+
+    vbars_lock_exclusive();
+    ret = source_insert(mv, src);
+    vbars_unlock_exclusive();
+    return ret;
+}
+
+static VbarCopy *populate_add(VbarPopulate *job) {
+    if (job->nr_copies == job->copies_cap) {
+        size_t new_cap = job->copies_cap ? job->copies_cap * 2 : 64;
+        VbarCopy *grown = (VbarCopy *)realloc(job->copies, new_cap * sizeof(*grown));
+
+        if (!grown) {
+            log(ERROR, "%s: out of memory\n", __func__);
+            return NULL;
+        }
+        job->copies = grown;
+        job->copies_cap = new_cap;
+    }
+    return &job->copies[job->nr_copies++];
+}
+
+/* Add the copies for whatever parts of the page have a source to job. Parts
+ * without one are left for the application. Under vbars_lock, as the
+ * sources can change without it.
+ */
+bool vbar_populate_page(ModelVBAR *mv, size_t page_nr, VbarPopulate *job) {
+    uint64_t page_start = (uint64_t)page_nr * mv->page_size;
+    uint64_t page_end = page_start + mv->page_size;
+    VbarCopy *copy;
+
+    for (size_t i = source_find(mv, page_start);
+         i < mv->nr_sources && mv->sources[i].offset < page_end; i++) {
+        VbarSource *src = &mv->sources[i];
+        uint64_t start = MAX(src->offset, page_start);
+        uint64_t size = MIN(src->offset + src->size, page_end) - start;
+
+        log(VVERBOSE, "%s: page %zu, %lldk at +%lldk\n", __func__, page_nr,
+            (ull)(size / K), (ull)((start - page_start) / K));
+
+        if (src->kind == VBAR_SOURCE_NONE) {
+            continue;
+        }
+        if (!(copy = populate_add(job))) {
+            return false;
+        }
+        copy->dst = mv->vbar + start;
+        copy->size = size;
+        copy->kind = src->kind;
+        if (src->kind == VBAR_SOURCE_FILE) {
+            copy->file.handle = src->file.handle;
+            copy->file.offset = src->file.offset + (start - src->offset);
+        } else {
+            copy->host = src->host + (start - src->offset);
+        }
+    }
+
+    /* Queued after the sources on the same stream, so the saved contents win */
+    if (!mv->residency_map[page_nr].written_back) {
+        return true;
+    }
+    for (size_t i = range_find(mv->writebacks, mv->nr_writebacks, page_start);
+         i < mv->nr_writebacks && mv->writebacks[i].offset < page_end; i++) {
+        VbarSource *wb = &mv->writebacks[i];
+        uint64_t start = MAX(wb->offset, page_start);
+
+        if (!(copy = populate_add(job))) {
+            return false;
+        }
+        copy->dst = mv->vbar + start;
+        copy->size = MIN(wb->offset + wb->size, page_end) - start;
+        copy->kind = VBAR_SOURCE_HOST;
+        copy->host = wb->host + (start - wb->offset);
+    }
+    return true;
+}
+
+/* Queue the copies of job on stream, without vbars_lock. The pages they
+ * write are claimed by the job, so they stay mapped.
+ */
+bool vbar_populate_issue(ModelVBAR *mv, VbarPopulate *job, cudaStream_t stream) {
+    for (size_t i = 0; i < job->nr_copies; i++) {
+        VbarCopy *copy = &job->copies[i];
+
+        if (copy->kind == VBAR_SOURCE_FILE) {
+            if (!hostbuf_file_reader_read(mv->device, copy->file.handle, copy->file.offset,
+                                          copy->size, stream, (uint64_t)copy->dst, true)) {
+                return false;
+            }
+        } else if (!CHECK_CU(cuMemcpyHtoDAsync(copy->dst, copy->host, copy->size, (CUstream)stream))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void vbar_populate_release(VbarPopulate *job) {
+    free(job->copies);
+    job->copies = NULL;
+    job->nr_copies = job->copies_cap = 0;
+}
+
+/* Queue copies of the page out to the write-back regions covering it. false
+ * if none do, and the contents are lost with the page.
+ */
+bool vbar_writeback_page(ModelVBAR *mv, size_t page_nr, cudaStream_t stream) {
+    uint64_t page_start = (uint64_t)page_nr * mv->page_size;
+    uint64_t page_end = page_start + mv->page_size;
+    bool saved = false;
+
+    for (size_t i = range_find(mv->writebacks, mv->nr_writebacks, page_start);
+         i < mv->nr_writebacks && mv->writebacks[i].offset < page_end; i++) {
+        VbarSource *wb = &mv->writebacks[i];
+        uint64_t start = MAX(wb->offset, page_start);
+        uint64_t size = MIN(wb->offset + wb->size, page_end) - start;
+
+        log(VVERBOSE, "%s: page %zu, %lldk at +%lldk\n", __func__, page_nr,
+            (ull)(size / K), (ull)((start - page_start) / K));
+        if (!CHECK_CU(cuMemcpyDtoHAsync((uint8_t *)wb->host + (start - wb->offset), mv->vbar + start,
+                                        size, (CUstream)stream))) {
+            return false;
+        }
+        saved = true;
+    }
+    return saved;
+}
+
+static inline uint64_t key_mix(uint64_t h, uint64_t v) {
+    h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+/* The content key of a page, combining the keys of every range in it along
+ * with where they sit. 0 if any range in it is unkeyed or there are none, as
+ * the contents are then unknown.
+ */
+uint64_t vbar_page_key(ModelVBAR *mv, size_t page_nr) {
+    uint64_t page_start = (uint64_t)page_nr * mv->page_size;
+    uint64_t page_end = page_start + mv->page_size;
+    uint64_t key = key_mix(0, mv->page_size);
+    bool keyed = false;
+
+    for (size_t i = source_find(mv, page_start);
+         i < mv->nr_sources && mv->sources[i].offset < page_end; i++) {
+        VbarSource *src = &mv->sources[i];
+
+        if (!src->key) {
+            return 0;
+        }
+        key = key_mix(key, src->key);
+        key = key_mix(key, src->offset - page_start); /* Wraps for ranges starting before */
+        key = key_mix(key, src->size);
+        keyed = true;
+    }
+    return keyed && key ? key : 0;
+}
+
+void vbar_sources_free(ModelVBAR *mv) {
+    free(mv->sources);
+    mv->sources = NULL;
+    mv->nr_sources = mv->sources_cap = 0;
+    free(mv->writebacks);
+    mv->writebacks = NULL;
+    mv->nr_writebacks = mv->writebacks_cap = 0;
+}
+
+SHARED_EXPORT
+bool vbar_attach_file(void *devctx, void *vbar, uint64_t offset, uint64_t size,
+                      uint64_t file_handle, uint64_t file_offset) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    VbarSource src = {
+        .offset = offset,
+        .size = size,
+        .kind = VBAR_SOURCE_FILE,
+        .file = { .handle = file_handle, .offset = file_offset },
+    };
+
+    set_devctx((AimdoContext *)devctx);
+    log(VERBOSE, "%s: offset=%lldk size=%lldk file_offset=%lldk\n", __func__,
+        (ull)(offset / K), (ull)(size / K), (ull)(file_offset / K));
+    return source_insert_locked(mv, &src);
+}
+
+/* host must stay valid, and should be page-locked (a HostBuffer region) for
+ * the copy to be asynchronous.
+ */
+SHARED_EXPORT
+bool vbar_attach_host(void *devctx, void *vbar, uint64_t offset, uint64_t size, const void *host) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    VbarSource src = {
+        .offset = offset,
+        .size = size,
+        .kind = VBAR_SOURCE_HOST,
+        .host = (const uint8_t *)host,
+    };
+
+    set_devctx((AimdoContext *)devctx);
+    log(VERBOSE, "%s: offset=%lldk size=%lldk host=%p\n", __func__,
+        (ull)(offset / K), (ull)(size / K), host);
+    return source_insert_locked(mv, &src);
+}
+
+/* Name the contents of [offset, offset + size) for the orphan cache, e.g. a
+ * hash of file identity, offset and length. The range is either an attached
+ * source or one the application populates itself. Every range sharing a page
+ * must be keyed for the page to be cached.
+ */
+SHARED_EXPORT
+bool vbar_set_key(void *devctx, void *vbar, uint64_t offset, uint64_t size, uint64_t key) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    VbarSource src = {
+        .offset = offset,
+        .size = size,
+        .key = key,
+        .kind = VBAR_SOURCE_NONE,
+    };
+    size_t i;
+    bool ret = true;
+
+    set_devctx((AimdoContext *)devctx);
+    log(VERBOSE, "%s: offset=%lldk size=%lldk key=%016llx\n", __func__,
+        (ull)(offset / K), (ull)(size / K), (ull)key);
+    vbars_lock_exclusive();
+    i = source_find(mv, offset);
+    if (i < mv->nr_sources && mv->sources[i].offset == offset && mv->sources[i].size == size) {
+        mv->sources[i].key = key;
+    } else {
+        ret = source_insert(mv, &src);
+    }
+    vbars_unlock_exclusive();
+    return ret;
+}
+
+/* Drop the source attached at offset. Pages already populated from it keep
+ * their contents.
+ */
+SHARED_EXPORT
+bool vbar_detach(void *devctx, void *vbar, uint64_t offset) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    size_t i;
+
+    set_devctx((AimdoContext *)devctx);
+    vbars_lock_exclusive();
+    i = source_find(mv, offset);
+    if (i == mv->nr_sources || mv->sources[i].offset != offset) {
+        vbars_unlock_exclusive();
+        log(WARNING, "%s: no source attached at %llx\n", __func__, (ull)offset);
+        return false;
+    }
+    memmove(&mv->sources[i], &mv->sources[i + 1], (mv->nr_sources - i - 1) * sizeof(*mv->sources));
+    mv->nr_sources--;
+    vbars_unlock_exclusive();
+    return true;
+}
+
+/* Give a clone the sources (and content keys) of the VBAR it was cloned from.
+ * Write-back regions stay with their VBAR.
+ */
+bool vbar_sources_copy(ModelVBAR *dst, ModelVBAR *src) {
+    if (!src->nr_sources) {
+        return true;
+    }
+    if (!(dst->sources = (VbarSource *)malloc(src->nr_sources * sizeof(*dst->sources)))) {
+        log(ERROR, "%s: out of memory\n", __func__);
+        return false;
+    }
+    memcpy(dst->sources, src->sources, src->nr_sources * sizeof(*dst->sources));
+    dst->nr_sources = dst->sources_cap = src->nr_sources;
+    return true;
+}
+
+/* Save dirty pages of [offset, offset + size) to host on eviction, and restore
+ * them from there. host is written from the device, so it should be
+ * page-locked (a HostBuffer region), and must outlive the VBAR.
+ */
+SHARED_EXPORT
+bool vbar_attach_writeback(void *devctx, void *vbar, uint64_t offset, uint64_t size, void *host) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    VbarSource wb = {
+        .offset = offset,
+        .size = size,
+        .kind = VBAR_SOURCE_HOST,
+        .host = (const uint8_t *)host,
+    };
+    bool ret;
+
+    set_devctx((AimdoContext *)devctx);
+    log(VERBOSE, "%s: offset=%lldk size=%lldk host=%p\n", __func__,
+        (ull)(offset / K), (ull)(size / K), host);
+    vbars_lock_exclusive();
+    ret = range_insert(mv, &mv->writebacks, &mv->nr_writebacks, &mv->writebacks_cap, &wb);
+    vbars_unlock_exclusive();
+    return ret;
+}
@@ -1,31 +1,4 @@
-#include "plat.h"
-
-#define VBAR_PAGE_SIZE (32 << 20)
-
-#define VBAR_GET_PAGE_NR(x) ((x) / VBAR_PAGE_SIZE)
-#define VBAR_GET_PAGE_NR_UP(x) VBAR_GET_PAGE_NR((x) + VBAR_PAGE_SIZE - 1)
-
-typedef struct ResidentPage {
-    CUmemGenericAllocationHandle handle;
-    uint32_t pin_count;
-    size_t serial;
-} ResidentPage;
-
-typedef struct ModelVBAR {
-    CUdeviceptr vbar;
-    size_t nr_pages;
-    size_t watermark;
-    size_t watermark_limit;
-
-    int device;
-
-    void *higher;
-    void *lower;
-
-    size_t resident_count;
-
-    ResidentPage residency_map[1]; /* Must be last! */
-} ModelVBAR;
+#include "model-vbar.h"
 
 static inline void one_time_setup() {
     if (!highest_priority_p) {
@@ -49,21 +22,32 @@ uint64_t vbars_analyze(void *devctx, bool only_dirty) {
 
     set_devctx((AimdoContext *)devctx);
 
+    vbars_lock_exclusive();
     one_time_setup();
     if (only_dirty && !vbars_dirty) {
+        vbars_unlock_exclusive();
         return 0;
     }
     vbars_dirty = false;
     log(DEBUG, "---------------- VBAR Usage ---------------\n")
+    log(DEBUG, "Eviction policy: %s\n", vbar_policy()->name);
 
     for (ModelVBAR *i = lowest_priority.higher; i && i != &highest_priority; i = i->higher) {
         size_t actual_resident_count = 0;
+        size_t shared_count = 0;
 
         for (size_t p = 0; p < i->nr_pages; p++) {
             ResidentPage *rp = &i->residency_map[p];
 
+            if (!rp->handle != !bitmap_test(i->resident, p)) {
+                log(WARNING, "VBAR %p: resident bitmap sync error at page %zu\n", (void*)i, p);
+            }
+
             if (rp->handle) {
                 actual_resident_count++;
+                if (rp->share && (rp->share->holders[0].mv != i || rp->share->holders[0].page_nr != p)) {
+                    shared_count++;
+                }
 
                 if (p >= i->watermark) {
                     log(WARNING, "VBAR %p: Resident page %zu is ABOVE watermark %zu\n",
@@ -73,6 +57,10 @@ uint64_t vbars_analyze(void *devctx, bool only_dirty) {
                 if (rp->pin_count) {
                     log(WARNING, "VBAR %p: Page %zu pin_count=%u\n", (void*)i, p, rp->pin_count);
                 }
+
+                if (!rp->heap_slot) {
+                    log(WARNING, "VBAR %p: Resident page %zu is not in the victim heap\n", (void*)i, p);
+                }
             }
         }
 
@@ -81,38 +69,264 @@ uint64_t vbars_analyze(void *devctx, bool only_dirty) {
                 (void*)i, i->resident_count, actual_resident_count);
         }
 
-        calculated_total_vram += (actual_resident_count * VBAR_PAGE_SIZE);
+        calculated_total_vram += ((actual_resident_count - shared_count) * i->page_size);
 
-        log(DEBUG, "VBAR %p: Actual Resident VRAM = %zu MB\n",
-            (void*)i, (actual_resident_count * VBAR_PAGE_SIZE) / M);
+        log(DEBUG, "VBAR %p: Actual Resident VRAM = %zu MB (page size %zu MB)\n",
+            (void*)i, (actual_resident_count * i->page_size) / M, i->page_size / M);
+        if (i->reserved_pages) {
+            log(DEBUG, "VBAR %p: Reserved %zu MB, %zu MB of it resident\n", (void*)i,
+                (i->reserved_pages * i->page_size) / M,
+                (MIN(actual_resident_count, i->reserved_pages) * i->page_size) / M);
+        }
+        if (shared_count) {
+            log(DEBUG, "VBAR %p: %zu MB mapped from other VBARs\n", (void*)i,
+                (shared_count * i->page_size) / M);
+        }
+        if (i->host_pages) {
+            log(DEBUG, "VBAR %p: %zu MB backed by host memory\n", (void*)i,
+                (i->host_pages * i->page_size) / M);
+        }
+        if (vbar_policy_id == VBAR_POLICY_FAIRSHARE) {
+            log(DEBUG, "VBAR %p: Weight %u\n", (void*)i, i->weight);
+        }
     }
 
     log(DEBUG, "Total VRAM for VBARs: %zu MB\n", calculated_total_vram / M);
+    log(DEBUG, "Total VRAM reserved for VBARs: %zu MB\n", (size_t)vbar_reserved / M);
+    vbars_unlock_exclusive();
     return (uint64_t)calculated_total_vram;
 }
 
-static inline bool mod1(ModelVBAR *mv, size_t page_nr, bool do_free, bool do_unpin) {
+/* Stream-ordered replacement for a context wide sync. Only the streams that
+ * actually used this page (as reported at unpin time) are waited on.
+ */
+static inline void page_fence_record(ResidentPage *rp, cudaStream_t stream) {
+    if (!rp->fence && !CHECK_CU(cuEventCreate(&rp->fence, CU_EVENT_DISABLE_TIMING))) {
+        rp->fence = NULL;
+        return;
+    }
+    CHECK_CU(cuEventRecord(rp->fence, (CUstream)stream));
+}
+
+/* The page's populate copies were just queued on stream. Without an event,
+ * wait for them here rather than leave other streams unordered.
+ */
+static inline void page_populate_record(ResidentPage *rp, cudaStream_t stream) {
+    if (!rp->populate_fence && !CHECK_CU(cuEventCreate(&rp->populate_fence, CU_EVENT_DISABLE_TIMING))) {
+        rp->populate_fence = NULL;
+    }
+    if (!rp->populate_fence || !CHECK_CU(cuEventRecord(rp->populate_fence, (CUstream)stream))) {
+        CHECK_CU(cuCtxSynchronize());
+        rp->populate_pending = false;
+        return;
+    }
+    rp->populate_stream = (CUstream)stream;
+    rp->populate_pending = true;
+}
+
+/* Order stream after the page's populate, which may have been queued on
+ * another stream. Once the copies have landed nobody needs to wait again.
+ */
+static inline void page_populate_wait(ResidentPage *rp, cudaStream_t stream) {
+    if (!rp->populate_pending) {
+        return;
+    }
+    if (cuEventQuery(rp->populate_fence) == CUDA_SUCCESS) {
+        rp->populate_pending = false;
+    } else if (rp->populate_stream != (CUstream)stream) {
+        CHECK_CU(cuStreamWaitEvent((CUstream)stream, rp->populate_fence, 0));
+    }
+}
+
+/* Called before a page loses its memory. A page that was prefetched and never
+ * used has no unpin fence, but its populate is somewhere on prefetch_stream.
+ */
+static inline void page_fence_wait(ResidentPage *rp) {
+    if (rp->populate_pending) {
+        CHECK_CU(cuEventSynchronize(rp->populate_fence));
+        rp->populate_pending = false;
+    }
+    if (rp->prefetched) {
+        page_fence_record(rp, (cudaStream_t)rp->prefetch_stream);
+        rp->prefetched = false;
+    }
+    if (rp->fence) {
+        CHECK_CU(cuEventSynchronize(rp->fence));
+    }
+}
+
+/* Copy a dirty page out to its write-back regions before it loses its memory.
+ * The caller's page_fence_wait() completes the copy.
+ */
+static inline void page_writeback(ModelVBAR *mv, size_t page_nr) {
     ResidentPage *rp = &mv->residency_map[page_nr];
-    CUdeviceptr vaddr = mv->vbar + page_nr * VBAR_PAGE_SIZE;
-
-    do_free = do_free && rp->handle && (do_unpin || rp->pin_count == 0);
-    if (do_free) {
-        CHECK_CU(cuMemUnmap(vaddr, VBAR_PAGE_SIZE));
-        unmap_workaround(vaddr, VBAR_PAGE_SIZE);
-        CHECK_CU(cuMemRelease(rp->handle));
-        total_vram_usage -= VBAR_PAGE_SIZE;
-        rp->handle = 0;
-        mv->resident_count--;
+
+    if (!rp->dirty) {
+        return;
+    }
+    page_fence_wait(rp);
+    if (vbar_writeback_page(mv, page_nr, NULL)) {
+        rp->written_back = true;
+        page_fence_record(rp, NULL);
+    } else {
+        log(DEBUG, "VBAR %p: dirty page %zu has no write-back region\n", (void *)mv, page_nr);
+    }
+    rp->dirty = false;
+}
+
+/* Unmap holder i of a shared page and forget it */
+static void share_unmap_holder(VbarShare *share, size_t i, int reason) {
+    ModelVBAR *mv = share->holders[i].mv;
+    size_t page_nr = share->holders[i].page_nr;
+    ResidentPage *rp = &mv->residency_map[page_nr];
+    CUdeviceptr vaddr = mv->vbar + page_nr * mv->page_size;
+
+    page_fence_wait(rp);
+    vbar_event_record(mv, page_nr, 1, reason);
+    CHECK_CU(cuMemUnmap(vaddr, mv->page_size));
+    unmap_workaround(vaddr, mv->page_size);
+    rp->handle = 0;
+    rp->share = NULL;
+    vbar_page_absent(mv, page_nr);
+    share->holders[i] = share->holders[--share->nr_holders];
+}
+
+static void share_free(VbarShare *share) {
+    free(share->holders);
+    free(share);
+}
+
+/* mod1() for a shared page. Eviction for memory takes it from every holder and
+ * frees the VRAM. A watermark or a VBAR going away only drops mv's mapping,
+ * and frees nothing.
+ */
+static size_t share_drop(ModelVBAR *mv, size_t page_nr, int reason) {
+    VbarShare *share = mv->residency_map[page_nr].share;
+    CUmemGenericAllocationHandle handle = share->handle;
+
+    if (reason == VBAR_EVICT_WATERMARK || reason == VBAR_EVICT_NONE) {
+        for (size_t i = 0; i < share->nr_holders; i++) {
+            if (share->holders[i].mv == mv && share->holders[i].page_nr == page_nr) {
+                share_unmap_holder(share, i, reason);
+                break;
+            }
+        }
+        if (share->nr_holders == 1) {
+            ModelVBAR *last = share->holders[0].mv;
+            size_t last_nr = share->holders[0].page_nr;
+            CUmemAccessDesc accessDesc = {
+                .location.type = CU_MEM_LOCATION_TYPE_DEVICE,
+                .location.id = last->device,
+                .flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE,
+            };
+
+            /* The last holder may have been mapped read-only. It owns the page now. */
+            CHECK_CU(cuMemSetAccess(last->vbar + last_nr * last->page_size, last->page_size,
+                                    &accessDesc, 1));
+            last->residency_map[last_nr].share = NULL;
+            share_free(share);
+        }
+        return 0;
+    }
+
+    while (share->nr_holders) {
+        share_unmap_holder(share, share->nr_holders - 1, reason);
+    }
+    vrampool_put(handle, mv->page_size);
+    share_free(share);
+    return 1;
+}
+
+/* Returns the number of pages freed, which is the whole run page_nr is in.
+ * reason is reported to vbar_events_drain() (VBAR_EVICT_NONE for nobody).
+ */
+static inline size_t mod1(ModelVBAR *mv, size_t page_nr, bool do_free, bool do_unpin, int reason) {
+    ResidentPage *rp = &mv->residency_map[page_nr];
+    size_t first = vbar_run_first(mv, page_nr);
+    size_t nr_pages = vbar_run_pages(mv, page_nr);
+    CUdeviceptr vaddr = mv->vbar + first * mv->page_size;
+
+    do_free = do_free && rp->handle && (do_unpin || !vbar_run_pinned(mv, page_nr));
+    if (do_free && rp->share) {
+        nr_pages = share_drop(mv, page_nr, reason);
+    } else if (do_free) {
+        for (size_t i = first; i < first + nr_pages && reason != VBAR_EVICT_NONE; i++) {
+            page_writeback(mv, i);
+        }
+        for (size_t i = first; i < first + nr_pages; i++) {
+            page_fence_wait(&mv->residency_map[i]);
+            mv->residency_map[i].dirty = false;
+            mv->residency_map[i].overlay = false;
+        }
+        vbar_event_record(mv, first, nr_pages, reason);
+        CHECK_CU(cuMemUnmap(vaddr, nr_pages * mv->page_size));
+        unmap_workaround(vaddr, nr_pages * mv->page_size);
+        vrampool_put(rp->handle, nr_pages * mv->page_size);
+        for (size_t i = first; i < first + nr_pages; i++) {
+            ResidentPage *run_rp = &mv->residency_map[i];
+
+            run_rp->handle = 0;
+            run_rp->run_pages = run_rp->run_index = 0;
+            vbar_page_absent(mv, i);
+        }
     }
     if (do_unpin) {
         rp->pin_count = 0;
     }
-    return do_free;
+    return do_free ? nr_pages : 0;
 }
 
-size_t vbars_free(ssize_t size) {
-    size_t pages_needed;
-    bool dirty = false;
+/* Back an absent page with pinned host memory at its VBAR address, for the
+ * device to read over the bus in place. It does not count against VRAM.
+ */
+static CUresult page_map_host(ModelVBAR *mv, size_t page_nr) {
+    ResidentPage *rp = &mv->residency_map[page_nr];
+    CUmemGenericAllocationHandle h;
+    CUresult err;
+
+    CUmemAllocationProp prop = {
+        .type = CU_MEM_ALLOCATION_TYPE_PINNED,
+        .location.type = CU_MEM_LOCATION_TYPE_HOST,
+    };
+
+    if (!CHECK_CU(err = cuMemCreate(&h, mv->page_size, &prop, 0))) {
+        return err;
+    }
+    if ((err = two_stooges(mv->vbar + page_nr * mv->page_size, mv->page_size, mv->device,
+                           h)) != CUDA_SUCCESS) {
+        CHECK_CU(cuMemRelease(h));
+        return err;
+    }
+    log(VERBOSE, "VBAR page %zu backed by host memory\n", page_nr);
+    rp->host_handle = h;
+    rp->serial = ++vbar_serial;
+    mv->host_pages++;
+    return CUDA_SUCCESS;
+}
+
+static void page_unmap_host(ModelVBAR *mv, size_t page_nr) {
+    ResidentPage *rp = &mv->residency_map[page_nr];
+    CUdeviceptr vaddr = mv->vbar + page_nr * mv->page_size;
+
+    if (!rp->host_handle) {
+        return;
+    }
+    page_fence_wait(rp);
+    CHECK_CU(cuMemUnmap(vaddr, mv->page_size));
+    unmap_workaround(vaddr, mv->page_size);
+    CHECK_CU(cuMemRelease(rp->host_handle));
+    rp->host_handle = 0;
+    mv->host_pages--;
+}
+
+/* Returns the number of bytes that could not be freed. Pages of protect below
+ * protect_end are left alone.
+ */
+static size_t vbars_free_protected(ssize_t size, ModelVBAR *protect, size_t protect_end,
+                                   int reason) {
+    ModelVBAR *victim;
+    size_t page_nr;
+    ssize_t owed;
 
     one_time_setup();
     vbars_dirty = true;
@@ -121,71 +335,204 @@ size_t vbars_free(ssize_t size) {
         return 0;
     }
 
-    pages_needed = VBAR_GET_PAGE_NR_UP((size_t)size);
+    /* Pressure from outside the VBARs. Recycled pages are the cheapest to give
+     * back, and anything evicted here has to go back to the driver too.
+     */
+    size -= (ssize_t)vrampool_trim((size_t)size, 0);
+    owed = size;
 
-    for (ModelVBAR *i = lowest_priority.higher; pages_needed && i != &highest_priority;
-         i = i->higher) {
-        for (;pages_needed && i->watermark > i->watermark_limit; i->watermark--) {
-            if (!dirty) {
-                CHECK_CU(cuCtxSynchronize());
-                dirty = true;
-            }
-            if (mod1(i, i->watermark - 1, true, false)) {
-                pages_needed--;
-            }
+    while (size > 0 && vbar_next_victim(protect, protect_end, &victim, &page_nr)) {
+        if (vbar_page_evictable(victim, page_nr, protect, protect_end)) {
+            size -= (ssize_t)(mod1(victim, page_nr, true, false, reason) * victim->page_size);
         }
     }
 
-    if (dirty) {
-        CHECK_CU(cuCtxSynchronize());
+    /* Evicted pages went to the pool. Release only what is still owed, which
+     * for the budget callers is what budget_deficit() was short, and keep the
+     * rest for later faults.
+     */
+    if (owed > 0) {
+        vrampool_trim((size_t)owed, 0);
     }
 
-    return pages_needed;
+    return size > 0 ? (size_t)size : 0;
 }
 
-static inline size_t move_cursor_to_absent(ModelVBAR *mv, size_t cursor) {
-    while (cursor < mv->watermark && mv->residency_map[cursor].handle) {
-        cursor++;
+/* One lock per device. Faults that find their range resident share it and
+ * serialise on the VBAR's own lock. Anything that maps, unmaps or moves pages
+ * between VBARs, the pool and the orphan cache takes it exclusively.
+ */
+void vbars_lock_exclusive(void) {
+    rwlock_write_lock((RwLock)vbars_lock);
+}
+
+void vbars_unlock_exclusive(void) {
+    rwlock_write_unlock((RwLock)vbars_lock);
+}
+
+static inline void vbars_lock_shared(void) {
+    rwlock_read_lock((RwLock)vbars_lock);
+}
+
+static inline void vbars_unlock_shared(void) {
+    rwlock_read_unlock((RwLock)vbars_lock);
+}
+
+size_t vbars_free(ssize_t size) {
+    size_t remaining;
+
+    vbars_lock_exclusive();
+    remaining = vbars_free_protected(size, NULL, 0, VBAR_EVICT_ALLOCATOR);
+    vbars_unlock_exclusive();
+    return remaining;
+}
+
+/* vbars_free(budget_deficit(size)), with the budget polled under the lock */
+size_t vbars_free_deficit(size_t size) {
+    size_t remaining;
+
+    vbars_lock_exclusive();
+    remaining = vbars_free_protected(budget_deficit(size), NULL, 0, VBAR_EVICT_ALLOCATOR);
+    vbars_unlock_exclusive();
+    return remaining;
+}
+
+/* Whether some VBAR faults in handles of size, i.e. whether the page pool
+ * can ever hand such a handle back out. Call under the exclusive lock.
+ */
+bool vbars_page_size_used(size_t size) {
+    if (!highest_priority_p) {
+        return false;
     }
-    return cursor;
+    for (ModelVBAR *i = lowest_priority.higher; i && i != &highest_priority; i = i->higher) {
+        if (i->page_size == size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* One background reclaim pass: evict up to batch bytes towards reserve bytes
+ * being free. Returns the bytes evicted, 0 once the reserve is there or
+ * nothing more can go.
+ */
+size_t vbars_reclaim(size_t reserve, size_t batch) {
+    ssize_t deficit;
+    size_t freed = 0;
+
+    vbars_lock_exclusive();
+    deficit = budget_deficit(reserve);
+    if (deficit > 0) {
+        size_t size = MIN((size_t)deficit, batch);
+
+        freed = size - vbars_free_protected((ssize_t)size, NULL, 0, VBAR_EVICT_RECLAIM);
+    }
+    vbars_unlock_exclusive();
+    return freed;
+}
+
+static inline size_t move_cursor_to_absent(ModelVBAR *mv, size_t cursor) {
+    return cursor < mv->watermark ? bitmap_find_next_clear(mv->resident, cursor, mv->watermark)
+                                  : cursor;
 }
 
 static inline size_t spend_surplus_on_cursor(ModelVBAR *mv, size_t target, size_t cursor,
                                              ssize_t *surplus) {
-    while (*surplus >= (ssize_t)VBAR_PAGE_SIZE && cursor < target && cursor < mv->watermark) {
-        *surplus -= (ssize_t)VBAR_PAGE_SIZE;
+    while (*surplus >= (ssize_t)mv->page_size && cursor < target && cursor < mv->watermark) {
+        *surplus -= (ssize_t)mv->page_size;
         cursor = move_cursor_to_absent(mv, cursor + 1);
     }
     return cursor;
 }
 
-static void vbars_free_for_vbar(ModelVBAR *mv, size_t target, ssize_t surplus) {
+/* Hand a victim page's physical memory straight to an absent page of the
+ * faulting VBAR: unmap from the old VA and map at the new one. There is no
+ * release/create pair and so no window for anyone else to take the VRAM.
+ * Returns false, with the victim untouched, if the page cannot move this way.
+ */
+static bool page_transfer(ModelVBAR *src, size_t src_nr, ModelVBAR *dst, size_t dst_nr) {
+    ResidentPage *from = &src->residency_map[src_nr];
+    ResidentPage *to = &dst->residency_map[dst_nr];
+    CUdeviceptr src_vaddr = src->vbar + src_nr * src->page_size;
+    CUdeviceptr dst_vaddr = dst->vbar + dst_nr * dst->page_size;
+    CUmemGenericAllocationHandle handle = from->handle;
+
+    if (!handle || from->pin_count || from->populating || from->run_pages || src->page_size != dst->page_size ||
+        src->device != dst->device || to->handle || to->host_handle || from->dirty || from->share) {
+        return false;
+    }
+
+    page_fence_wait(from);
+    vbar_event_record(src, src_nr, 1, VBAR_EVICT_FAULT);
+    CHECK_CU(cuMemUnmap(src_vaddr, src->page_size));
+    unmap_workaround(src_vaddr, src->page_size);
+    from->handle = 0;
+    /* As for mod1(): what was written to the page goes with it. A write-back
+     * copy on the host stays, and the page repopulates from it.
+     */
+    from->dirty = false;
+    from->overlay = false;
+    vbar_page_absent(src, src_nr);
+
+    if (two_stooges(dst_vaddr, dst->page_size, dst->device, handle) != CUDA_SUCCESS) {
+        log(DEBUG, "%s: remap failed, recycling page instead\n", __func__);
+        vrampool_put(handle, src->page_size);
+        return true;
+    }
+
+    log(VERBOSE, "%s: VBAR %p page %zu -> VBAR %p page %zu\n", __func__,
+        (void *)src, src_nr, (void *)dst, dst_nr);
+    to->handle = handle;
+    to->serial = ++vbar_serial;
+    vbar_page_resident(dst, dst_nr);
+    return true;
+}
+
+/* first is the first page the caller is actually faulting. Absent pages below
+ * it still claim budget for priority reasons, but only pages from first up are
+ * worth handing victim memory to directly.
+ */
+static void vbars_free_for_vbar(ModelVBAR *mv, size_t first, size_t target, ssize_t surplus) {
     size_t cursor = move_cursor_to_absent(mv, 0);
-    bool synced = false;
+    bool evicted = false;
+    ModelVBAR *victim;
+    size_t page_nr;
+    size_t freed;
+
+    /* Recycled pages of our size are as good as free. Any other size is dead
+     * weight under pressure.
+     */
+    surplus += (ssize_t)vrampool_available(mv->page_size);
+    if (surplus < 0) {
+        surplus += (ssize_t)vrampool_trim((size_t)-surplus, mv->page_size);
+    }
 
     cursor = spend_surplus_on_cursor(mv, target, cursor, &surplus);
 
-    for (ModelVBAR *i = lowest_priority.higher;
-         ((cursor < target && cursor < mv->watermark) || surplus < 0) && i != &highest_priority;
-         i = i->higher) {
-        for (; ((cursor < target && cursor < mv->watermark) || surplus < 0) &&
-               i->watermark > i->watermark_limit;
-             i->watermark--) {
-            ResidentPage *rp = &i->residency_map[i->watermark - 1];
-
-            if (!synced && rp->handle && rp->pin_count == 0) {
-                CHECK_CU(cuCtxSynchronize());
-                synced = true;
-            }
-            if (mod1(i, i->watermark - 1, true, false)) {
-                surplus += (ssize_t)VBAR_PAGE_SIZE;
-                cursor = spend_surplus_on_cursor(mv, target, cursor, &surplus);
+    while (((cursor < target && cursor < mv->watermark) || surplus < 0) &&
+           vbar_next_victim(mv, target, &victim, &page_nr)) {
+        if (!vbar_page_evictable(victim, page_nr, mv, target)) {
+            continue;
+        }
+        if (surplus >= 0 && cursor >= first && cursor < target && cursor < mv->watermark &&
+            page_transfer(victim, page_nr, mv, cursor)) {
+            if (mv->residency_map[cursor].handle) {
+                vbar_page_touch(mv, &mv->residency_map[cursor], true);
+                cursor = move_cursor_to_absent(mv, cursor + 1);
+                continue;
             }
+            evicted = true;
+            surplus += (ssize_t)victim->page_size;
+            cursor = spend_surplus_on_cursor(mv, target, cursor, &surplus);
+        } else if ((freed = mod1(victim, page_nr, true, false, VBAR_EVICT_FAULT))) {
+            evicted = true;
+            surplus += (ssize_t)(freed * victim->page_size);
+            cursor = spend_surplus_on_cursor(mv, target, cursor, &surplus);
         }
     }
 
-    if (synced) {
-        CHECK_CU(cuCtxSynchronize());
+    if (evicted) {
+        vrampool_trim(SIZE_MAX, mv->page_size);
     }
 }
 
@@ -208,43 +555,167 @@ static inline void insert_vbar_last(ModelVBAR *mv) {
     lowest_priority.higher = mv;
 }
 
+/* page_size of 0 selects VBAR_PAGE_SIZE_DEFAULT */
 SHARED_EXPORT
-void *vbar_allocate(void *devctx, uint64_t size, int device) {
+void *vbar_allocate(void *devctx, uint64_t size, int device, uint64_t page_size) {
     ModelVBAR *mv;
 
     set_devctx((AimdoContext *)devctx);
 
-    one_time_setup();
     log_reset_shots();
-    log(DEBUG, "%s (start): size=%zuM, device=%d\n", __func__, size / M, device);
-    vbars_dirty = true;
+    log(DEBUG, "%s (start): size=%zuM, device=%d, page_size=%zuk\n", __func__,
+        size / M, device, (size_t)page_size / K);
 
-    size_t nr_pages = VBAR_GET_PAGE_NR_UP(size);
-    size_t nr_pages_max = VBAR_GET_PAGE_NR(vram_capacity);
-    if (nr_pages_max < nr_pages) {
-        nr_pages = nr_pages_max;
+    if (!page_size) {
+        page_size = VBAR_PAGE_SIZE_DEFAULT;
+    }
+    if (page_size < alloc_granularity || page_size > VBAR_PAGE_SIZE_MAX ||
+        page_size % alloc_granularity) {
+        log(ERROR, "Invalid VBAR page size %zuk (granularity %zuk, max %zuk)\n",
+            (size_t)page_size / K, (size_t)alloc_granularity / K, (size_t)VBAR_PAGE_SIZE_MAX / K);
+        return NULL;
     }
-    size = (uint64_t)nr_pages * VBAR_PAGE_SIZE;
 
-    if (!(mv = calloc(1, sizeof(*mv) + nr_pages * sizeof(mv->residency_map[0])))) {
+    /* The VA size is independent of VRAM. Pages beyond what fits just stay
+     * absent, as they would under any other VRAM pressure.
+     */
+    size_t nr_pages = MAX((size + page_size - 1) / page_size, 1);
+    size = (uint64_t)nr_pages * page_size;
+
+    if (!(mv = calloc(1, sizeof(*mv))) ||
+        !(mv->residency_map = (ResidentPage *)calloc(nr_pages, sizeof(mv->residency_map[0]))) ||
+        !(mv->resident = (uint64_t *)calloc(BITMAP_WORDS(nr_pages), sizeof(uint64_t))) ||
+        !(mv->prefetched = (uint64_t *)calloc(BITMAP_WORDS(nr_pages), sizeof(uint64_t))) ||
+        !(mv->segment_ends = (size_t *)malloc(sizeof(mv->segment_ends[0]))) ||
+        !(mv->lock = mutex_create()) || !(mv->populate_cond = condvar_create())) {
         log(CRITICAL, "Host OOM\n");
-        return NULL;
+        goto fail;
     }
 
     /* FIXME: Do I care about alignment? Does Cuda just look after itself? */
     if (!CHECK_CU(cuMemAddressReserve(&mv->vbar, size, 0, 0, 0))) {
         log(ERROR, "Could not reseve Virtual Address space for VBAR\n");
-        free(mv);
-        return NULL;
+        goto fail;
     }
+    mv->segment_ends[0] = nr_pages;
+    mv->nr_segments = 1;
 
     mv->device = device;
+    mv->page_size = page_size;
     mv->nr_pages = mv->watermark = nr_pages;
-    
+    mv->weight = 1;
+
+    vbars_lock_exclusive();
+    if (!vbar_heap_reserve(nr_pages)) {
+        vbars_unlock_exclusive();
+        CHECK_CU(cuMemAddressFree(mv->vbar, size));
+        goto fail;
+    }
+    one_time_setup();
+    vbars_dirty = true;
     insert_vbar(mv);
+    vbars_unlock_exclusive();
 
     log(DEBUG, "%s (return): vbar=%p\n", __func__, (void *)mv);
     return mv;
+
+fail:
+    if (mv) {
+        if (mv->lock) {
+            mutex_destroy(mv->lock);
+        }
+        if (mv->populate_cond) {
+            condvar_destroy(mv->populate_cond);
+        }
+        free(mv->segment_ends);
+        free(mv->resident);
+        free(mv->prefetched);
+        free(mv->residency_map);
+        free(mv);
+    }
+    return NULL;
+}
+
+/* Make the VBAR size bytes long, keeping its base address and everything in
+ * it. The extra VA is reserved right after the existing range as a new
+ * segment. Fails, changing nothing, if the driver cannot place it there.
+ * Shrinking is not supported.
+ */
+SHARED_EXPORT
+bool vbar_grow(void *devctx, void *vbar, uint64_t size) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    size_t nr_pages = (size + mv->page_size - 1) / mv->page_size;
+    CUdeviceptr want, got = 0;
+    ResidentPage *residency_map;
+    uint64_t *resident;
+    size_t *segment_ends;
+    bool ret = false;
+
+    set_devctx((AimdoContext *)devctx);
+
+    log(DEBUG, "%s: vbar=%p size=%zuM\n", __func__, vbar, (size_t)(size / M));
+
+    vbars_lock_exclusive();
+    if (nr_pages <= mv->nr_pages) {
+        ret = true;
+        goto out;
+    }
+
+    /* Host side first. Bigger arrays are harmless if the VA is not there. */
+    if (!(residency_map = (ResidentPage *)realloc(mv->residency_map, nr_pages * sizeof(*residency_map)))) {
+        log(CRITICAL, "Host OOM\n");
+        goto out;
+    }
+    mv->residency_map = residency_map;
+    memset(&residency_map[mv->nr_pages], 0, (nr_pages - mv->nr_pages) * sizeof(*residency_map));
+
+    if (!(resident = (uint64_t *)realloc(mv->resident, BITMAP_WORDS(nr_pages) * sizeof(*resident)))) {
+        log(CRITICAL, "Host OOM\n");
+        goto out;
+    }
+    mv->resident = resident;
+    memset(&resident[BITMAP_WORDS(mv->nr_pages)], 0,
+           (BITMAP_WORDS(nr_pages) - BITMAP_WORDS(mv->nr_pages)) * sizeof(*resident));
+
+    if (!(resident = (uint64_t *)realloc(mv->prefetched, BITMAP_WORDS(nr_pages) * sizeof(*resident)))) {
+        log(CRITICAL, "Host OOM\n");
+        goto out;
+    }
+    mv->prefetched = resident;
+    memset(&resident[BITMAP_WORDS(mv->nr_pages)], 0,
+           (BITMAP_WORDS(nr_pages) - BITMAP_WORDS(mv->nr_pages)) * sizeof(*resident));
+
+    if (!(segment_ends = (size_t *)realloc(mv->segment_ends, (mv->nr_segments + 1) * sizeof(*segment_ends)))) {
+        log(CRITICAL, "Host OOM\n");
+        goto out;
+    }
+    mv->segment_ends = segment_ends;
+
+    want = mv->vbar + mv->nr_pages * mv->page_size;
+    if (!CHECK_CU(cuMemAddressReserve(&got, (nr_pages - mv->nr_pages) * mv->page_size, 0, want, 0))) {
+        goto out;
+    }
+    if (got != want) {
+        log(ERROR, "%s: VA after VBAR %p is taken, cannot grow in place\n", __func__, vbar);
+        CHECK_CU(cuMemAddressFree(got, (nr_pages - mv->nr_pages) * mv->page_size));
+        goto out;
+    }
+    if (!vbar_heap_reserve(nr_pages - mv->nr_pages)) {
+        CHECK_CU(cuMemAddressFree(got, (nr_pages - mv->nr_pages) * mv->page_size));
+        goto out;
+    }
+
+    segment_ends[mv->nr_segments++] = nr_pages;
+    if (mv->watermark == mv->nr_pages) {
+        mv->watermark = nr_pages;
+    }
+    mv->nr_pages = nr_pages;
+    vbars_dirty = true;
+    ret = true;
+
+out:
+    vbars_unlock_exclusive();
+    return ret;
 }
 
 SHARED_EXPORT
@@ -254,42 +725,164 @@ void vbar_set_watermark_limit(void *devctx, void *vbar, uint64_t size) {
     set_devctx((AimdoContext *)devctx);
 
     log(DEBUG, "%s: size=%zu\n", __func__, size);
-    mv->watermark_limit = VBAR_GET_PAGE_NR_UP(size);
+    vbars_lock_exclusive();
+    mv->watermark_limit = VBAR_GET_PAGE_NR_UP(mv, size);
+    vbars_unlock_exclusive();
+}
+
+/* Guarantee size bytes of the VBAR stay resident once faulted. Eviction for
+ * other VBARs, the pytorch allocator and the background reclaimer leaves the
+ * VBAR at least that much. Returns false, leaving the old reservation, if the
+ * reservations of all VBARs would not fit in VRAM less the headroom.
+ */
+SHARED_EXPORT
+bool vbar_set_reservation(void *devctx, void *vbar, uint64_t size) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    size_t pages = MIN(VBAR_GET_PAGE_NR_UP(mv, size), mv->nr_pages);
+    uint64_t old_bytes = (uint64_t)mv->reserved_pages * mv->page_size;
+    uint64_t new_bytes = (uint64_t)pages * mv->page_size;
+    uint64_t limit;
+    bool ret = true;
+
+    set_devctx((AimdoContext *)devctx);
+
+    log(DEBUG, "%s: vbar=%p size=%zu MB\n", __func__, vbar, (size_t)new_bytes / M);
+    vbars_lock_exclusive();
+    limit = vram_capacity - MIN(vram_capacity, (uint64_t)simple_vram_headroom + extra_vram_headroom);
+    if (vbar_reserved - old_bytes + new_bytes > limit) {
+        log(WARNING, "%s: %zu MB would take reservations to %zu MB of %zu MB\n", __func__,
+            (size_t)new_bytes / M, (size_t)(vbar_reserved - old_bytes + new_bytes) / M,
+            (size_t)limit / M);
+        ret = false;
+    } else {
+        vbar_reserved = vbar_reserved - old_bytes + new_bytes;
+        mv->reserved_pages = pages;
+        vbars_dirty = true;
+    }
+    vbars_unlock_exclusive();
+    return ret;
+}
+
+/* The VBAR's share of VRAM relative to the others under the fair-share policy,
+ * 1 by default. Has no effect under the other policies.
+ */
+SHARED_EXPORT
+void vbar_set_weight(void *devctx, void *vbar, uint32_t weight) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+
+    set_devctx((AimdoContext *)devctx);
+
+    log(DEBUG, "%s: vbar=%p weight=%u\n", __func__, vbar, weight);
+    vbars_lock_exclusive();
+    mv->weight = MAX(weight, 1);
+    vbars_unlock_exclusive();
+}
+
+/* How fast the contents of [offset, offset + size) come back once evicted, in
+ * bytes/sec of their source, e.g. high for pinned host memory and low for a
+ * network filesystem. size 0 sets it for every page without one of its own,
+ * and bytes_per_sec 0 goes back to the default. The cost policy credits pages
+ * by it and the priority policy trades neighbouring VBARs for it.
+ */
+SHARED_EXPORT
+void vbar_set_reload_bw(void *devctx, void *vbar, uint64_t offset, uint64_t size,
+                        uint64_t bytes_per_sec) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    size_t page_end;
+
+    set_devctx((AimdoContext *)devctx);
+
+    log(DEBUG, "%s: offset=%lldk size=%lldk bw=%zu MB/s\n", __func__, (ull)(offset / K),
+        (ull)(size / K), (size_t)(bytes_per_sec / M));
+    vbars_lock_exclusive();
+    if (!size) {
+        mv->reload_bw = bytes_per_sec;
+    } else {
+        page_end = MIN(VBAR_GET_PAGE_NR_UP(mv, offset + size), mv->nr_pages);
+        for (size_t page_nr = VBAR_GET_PAGE_NR(mv, offset); page_nr < page_end; page_nr++) {
+            mv->residency_map[page_nr].reload_bw = bytes_per_sec;
+        }
+    }
+    vbars_unlock_exclusive();
+}
+
+/* Allow up to max_size of the VBAR to be backed by pinned host memory by
+ * vbar_fault_host(). 0 disables it and drops the host pages nothing has pinned.
+ * false if the driver cannot map host memory at VBAR page granularity.
+ */
+SHARED_EXPORT
+bool vbar_set_host_fallback(void *devctx, void *vbar, uint64_t max_size) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    CUmemAllocationProp prop = {
+        .type = CU_MEM_ALLOCATION_TYPE_PINNED,
+        .location.type = CU_MEM_LOCATION_TYPE_HOST,
+    };
+    size_t granularity = 0;
+
+    set_devctx((AimdoContext *)devctx);
+
+    log(DEBUG, "%s: vbar=%p max_size=%zu MB\n", __func__, vbar, (size_t)(max_size / M));
+    if (max_size && (!CHECK_CU(cuMemGetAllocationGranularity(&granularity, &prop,
+                                                             CU_MEM_ALLOC_GRANULARITY_MINIMUM)) ||
+                     !granularity || mv->page_size % granularity)) {
+        log(WARNING, "%s: host memory pages not supported (granularity %zuk)\n", __func__,
+            granularity / K);
+        return false;
+    }
+
+    vbars_lock_exclusive();
+    mv->host_pages_limit = (size_t)MIN(max_size / mv->page_size, (uint64_t)mv->nr_pages);
+    for (size_t page_nr = mv->nr_pages; page_nr-- > 0 && mv->host_pages > mv->host_pages_limit;) {
+        ResidentPage *rp = &mv->residency_map[page_nr];
+
+        if (!rp->pin_count && !rp->graph_locks) {
+            page_unmap_host(mv, page_nr);
+        }
+    }
+    vbars_unlock_exclusive();
+    return true;
 }
 
 SHARED_EXPORT
 void vbar_set_watermark(void *devctx, void *vbar, uint64_t size) {
     ModelVBAR *mv = (ModelVBAR *)vbar;
-    size_t watermark = VBAR_GET_PAGE_NR_UP(size);
+    size_t watermark = VBAR_GET_PAGE_NR_UP(mv, size);
 
     set_devctx((AimdoContext *)devctx);
 
     log(DEBUG, "%s: size=%zu\n", __func__, size);
+    vbars_lock_exclusive();
     vbars_dirty = true;
 
     if (watermark > mv->nr_pages) {
         watermark = mv->nr_pages;
     }
+    if (watermark < mv->locked_end) {
+        log(WARNING, "%s: watermark held at %zu by a graph lock\n", __func__, mv->locked_end);
+        watermark = mv->locked_end;
+    }
 
     if (watermark < mv->watermark) {
-        CHECK_CU(cuCtxSynchronize());
         for (size_t page_nr = watermark; page_nr < mv->watermark; page_nr++) {
-            mod1(mv, page_nr, true, false);
+            mod1(mv, page_nr, true, false, VBAR_EVICT_WATERMARK);
         }
     }
 
     mv->watermark = watermark;
+    vbars_unlock_exclusive();
 }
 
 SHARED_EXPORT
 void vbars_reset_watermark_limits(void *devctx) {
     set_devctx((AimdoContext *)devctx);
-    one_time_setup();
     log(VERBOSE, "%s\n", __func__);
 
+    vbars_lock_exclusive();
+    one_time_setup();
     for (ModelVBAR *i = lowest_priority.higher; i && i != &highest_priority; i = i->higher) {
         i->watermark_limit = 0;
     }
+    vbars_unlock_exclusive();
 }
 
 SHARED_EXPORT
@@ -299,14 +892,15 @@ void vbar_prioritize(void *devctx, void *vbar) {
     set_devctx((AimdoContext *)devctx);
 
     log(DEBUG, "%s vbar=%p\n", __func__, vbar);
-    vbars_dirty = true;
-
     log_reset_shots();
 
+    vbars_lock_exclusive();
+    vbars_dirty = true;
     remove_vbar(mv);
     insert_vbar(mv);
 
     mv->watermark = mv->nr_pages;
+    vbars_unlock_exclusive();
 }
 
 SHARED_EXPORT
@@ -316,12 +910,13 @@ void vbar_deprioritize(void *devctx, void *vbar) {
     set_devctx((AimdoContext *)devctx);
 
     log(DEBUG, "%s vbar=%p\n", __func__, vbar);
-    vbars_dirty = true;
-
     log_reset_shots();
 
+    vbars_lock_exclusive();
+    vbars_dirty = true;
     remove_vbar(mv);
     insert_vbar_last(mv);
+    vbars_unlock_exclusive();
 }
 
 SHARED_EXPORT
@@ -331,120 +926,1375 @@ uint64_t vbar_get(void *devctx, void *vbar) {
     return (uint64_t)((ModelVBAR *)vbar)->vbar;
 }
 
-#define VBAR_FAULT_SUCCESS           0
-#define VBAR_FAULT_OOM               1
-#define VBAR_FAULT_ERROR             2
+/* Pinning is the real use a prefetch was waiting for */
+static inline void pin_range(ModelVBAR *mv, uint64_t offset, uint64_t size) {
+    size_t page_end = VBAR_GET_PAGE_NR_UP(mv, offset + size);
 
-SHARED_EXPORT
-int vbar_fault(void *devctx, void *vbar, uint64_t offset, uint64_t size, uint32_t *signature) {
-    ModelVBAR *mv = (ModelVBAR *)vbar;
-    int ret = VBAR_FAULT_SUCCESS;
-    size_t signature_index = 0;
-    bool miss_alloc_checked = false;
+    for (uint64_t page_nr = VBAR_GET_PAGE_NR(mv, offset); page_nr < page_end; page_nr++) {
+        mv->residency_map[page_nr].pin_count++;
+        mv->residency_map[page_nr].prefetched = false;
+    }
+}
 
-    set_devctx((AimdoContext *)devctx);
+static inline ssize_t fault_surplus(ModelVBAR *mv, size_t pages_missing) {
+    return (ssize_t)vram_capacity -
+           ((ssize_t)(total_vram_usage + pages_missing * mv->page_size) +
+            (ssize_t)simple_vram_headroom);
+}
 
-    size_t page_end = VBAR_GET_PAGE_NR_UP(offset + size);
+/* Take the page's contents over from the orphan cache, if a freed VBAR left
+ * them there. The serial comes along, so the signature is unchanged.
+ */
+static bool page_adopt(ModelVBAR *mv, size_t page_nr) {
+    ResidentPage *rp = &mv->residency_map[page_nr];
+    CUdeviceptr vaddr = mv->vbar + page_nr * mv->page_size;
+    CUmemGenericAllocationHandle handle;
+    uint64_t key;
+    size_t serial;
 
-    log(VVERBOSE, "%s (start): offset=%lldk, size=%lldk\n", __func__, (ull)(offset / K), (ull)(size / K));
-    vbars_dirty = true;
+    if (!vram_orphans || rp->written_back || !(key = vbar_page_key(mv, page_nr)) ||
+        !vrampool_adopt(key, mv->page_size, &handle, &serial)) {
+        return false;
+    }
+    if (two_stooges(vaddr, mv->page_size, mv->device, handle) != CUDA_SUCCESS) {
+        vrampool_put(handle, mv->page_size);
+        return false;
+    }
+    log(VERBOSE, "VBAR adopted page %zu (key %016llx)\n", page_nr, (ull)key);
+    rp->handle = handle;
+    rp->serial = rp->populated_serial = serial;
+    vbar_page_touch(mv, rp, true);
+    vbar_page_resident(mv, page_nr);
+    return true;
+}
 
-    /* Stopgap. If the we get a bad shared memory spike, collect it here on the next layer
-     * as the allocator is unreliable as it may not actually be called reliably when you
-     * really need to know you have spilled.
-     */
-    vbars_free(budget_deficit(0));
+/* Give the absent pages from page_nr up to the next resident page (or page_end)
+ * memory as one allocation: one cuMemCreate, cuMemMap and cuMemSetAccess for
+ * the lot. Only on a cold path, where recycled and orphaned pages are not worth
+ * keeping single and the budget has room for the whole run. Returns the number
+ * of pages faulted, 0 to fall back to faulting page by page.
+ */
+static size_t fault_run(ModelVBAR *mv, size_t page_nr, size_t page_end) {
+    size_t run_end = MIN(page_end, page_nr + VBAR_RUN_SIZE_MAX / mv->page_size);
+    CUmemGenericAllocationHandle handle;
+    size_t nr_pages;
+
+    run_end = bitmap_find_next(mv->resident, page_nr, MIN(run_end, vbar_segment_end(mv, page_nr)));
+    for (size_t i = page_nr; i < run_end; i++) {
+        if (mv->residency_map[i].host_handle) {
+            run_end = i;
+            break;
+        }
+    }
+    nr_pages = run_end - page_nr;
+    if (nr_pages < 2 || vram_orphans || vrampool_available(mv->page_size) ||
+        budget_deficit(nr_pages * mv->page_size) > 0 ||
+        three_stooges(mv->vbar + page_nr * mv->page_size, nr_pages * mv->page_size, mv->device,
+                      &handle) != CUDA_SUCCESS) {
+        return 0;
+    }
+
+    log(VERBOSE, "VBAR allocated pages %zu-%zu as one run\n", page_nr, run_end - 1);
+    for (size_t i = 0; i < nr_pages; i++) {
+        ResidentPage *rp = &mv->residency_map[page_nr + i];
+
+        rp->handle = handle;
+        rp->run_pages = (uint32_t)nr_pages;
+        rp->run_index = (uint32_t)i;
+        vbar_page_touch(mv, rp, true);
+        rp->serial = ++vbar_serial;
+        vbar_page_resident(mv, page_nr + i);
+    }
+    return nr_pages;
+}
+
+/* Make [offset, offset + size) resident without pinning it. The caller owns the
+ * budget poll and, if miss_alloc_checked is set, has already made space for the
+ * whole range with vbars_free_for_vbar(). Eviction leaves pages of mv below
+ * protect_end alone too (0 for just the range), for a batch faulted together.
+ */
+static int fault_range(ModelVBAR *mv, uint64_t offset, uint64_t size, uint32_t *signature,
+                       bool miss_alloc_checked, size_t protect_end) {
+    size_t signature_index = 0;
+    size_t page_end = VBAR_GET_PAGE_NR_UP(mv, offset + size);
 
     if (page_end > mv->watermark) {
         log(VVERBOSE, "VBAR Allocation is above watermark\n");
         return VBAR_FAULT_OOM;
     }
 
-    for (uint64_t page_nr = VBAR_GET_PAGE_NR(offset); page_nr < page_end; page_nr++) {
+    for (uint64_t page_nr = VBAR_GET_PAGE_NR(mv, offset); page_nr < page_end; page_nr++) {
         CUresult err = CUDA_ERROR_OUT_OF_MEMORY;
-        CUdeviceptr vaddr = mv->vbar + page_nr * VBAR_PAGE_SIZE;
+        CUdeviceptr vaddr = mv->vbar + page_nr * mv->page_size;
         ResidentPage *rp = &mv->residency_map[page_nr];
+        size_t run;
 
         if (rp->handle) {
+            vbar_page_touch(mv, rp, false);
             signature[signature_index++] = rp->serial;
             continue;
         }
 
-        if (!miss_alloc_checked) {
-            vbars_free_for_vbar(mv, page_end,
-                                (ssize_t)vram_capacity -
-                                ((ssize_t)(total_vram_usage +
-                                           (page_end - page_nr) * VBAR_PAGE_SIZE) +
-                                 (ssize_t)simple_vram_headroom));
-            miss_alloc_checked = true;
-
-            if (page_end > mv->watermark) {
+        /* VRAM for a page read from host memory. Not while something still uses it there. */
+        if (rp->host_handle) {
+            if (rp->pin_count || rp->graph_locks) {
+                log(DEBUG, "VBAR page %zu is pinned in host memory\n", (size_t)page_nr);
+                return VBAR_FAULT_OOM;
+            }
+            page_unmap_host(mv, page_nr);
+        }
+
+        if (page_adopt(mv, page_nr)) {
+            signature[signature_index++] = rp->serial;
+            continue;
+        }
+
+        if (!miss_alloc_checked) {
+            vbars_free_for_vbar(mv, page_nr, page_end, fault_surplus(mv, page_end - page_nr));
+            miss_alloc_checked = true;
+
+            if (page_end > mv->watermark) {
                 log(DEBUG, "VBAR allocation cancelled due to allocation-check watermark reduction\n");
                 return VBAR_FAULT_OOM;
             }
         }
 
+        if ((run = fault_run(mv, page_nr, page_end))) {
+            for (size_t i = 0; i < run; i++) {
+                signature[signature_index++] = mv->residency_map[page_nr + i].serial;
+            }
+            page_nr += run - 1;
+            continue;
+        }
+
         log(VERBOSE, "VBAR needs to allocate VRAM for page %d\n", (int)page_nr);
 
-        if (budget_deficit(VBAR_PAGE_SIZE) > 0 ||
-            (err = three_stooges(vaddr, VBAR_PAGE_SIZE, mv->device, &rp->handle)) != CUDA_SUCCESS) {
+        if ((!vrampool_available(mv->page_size) && budget_deficit(mv->page_size) > 0) ||
+            (err = three_stooges(vaddr, mv->page_size, mv->device, &rp->handle)) != CUDA_SUCCESS) {
             if (err != CUDA_ERROR_OUT_OF_MEMORY) {
                 log(ERROR, "VRAM Allocation failed (non OOM)\n");
                 return VBAR_FAULT_ERROR;
             }
             log(DEBUG, "VBAR allocator attempt exceeds available VRAM ...\n");
-            vbars_free(VBAR_PAGE_SIZE);
+            vbars_free_protected(mv->page_size, mv, MAX(page_end, protect_end), VBAR_EVICT_FAULT);
             if (page_end > mv->watermark) {
                 log(DEBUG, "VBAR allocation cancelled due to backup-free watermark reduction\n");
                 return VBAR_FAULT_OOM;
             }
-            if ((err = three_stooges(vaddr, VBAR_PAGE_SIZE, mv->device, &rp->handle)) != CUDA_SUCCESS) {
+            if ((err = three_stooges(vaddr, mv->page_size, mv->device, &rp->handle)) != CUDA_SUCCESS) {
+                if (err == CUDA_ERROR_OUT_OF_MEMORY && !vbar_policy()->truncates_watermark) {
+                    /* Nothing left to evict and no watermark to say so */
+                    log(DEBUG, "VBAR allocation cancelled, nothing evictable\n");
+                    return VBAR_FAULT_OOM;
+                }
                 log(ERROR, "VRAM Allocation failed\n");
                 return VBAR_FAULT_ERROR;
             }
         }
-        rp->serial++;
+        vbar_page_touch(mv, rp, true);
+        rp->serial = ++vbar_serial;
         signature[signature_index++] = rp->serial;
-        mv->resident_count++;
+        vbar_page_resident(mv, page_nr);
+    }
+
+    return VBAR_FAULT_SUCCESS;
+}
+
+/* Claim the resident pages of the range that have not been populated since
+ * they last got memory for job, and gather their copies. Under the exclusive
+ * lock. Pages another populate has claimed are left to it. Returns false if
+ * the copies could not be gathered, with the pages claimed so far still
+ * claimed for populate_finish() to drop.
+ */
+static bool populate_claim(ModelVBAR *mv, uint64_t offset, uint64_t size, VbarPopulate *job) {
+    size_t page_end = MIN(VBAR_GET_PAGE_NR_UP(mv, offset + size), mv->nr_pages);
+    bool ret = true;
+
+    if (!mv->nr_sources && !mv->nr_writebacks) {
+        return true;
+    }
+    mutex_lock(mv->lock);
+    for (size_t page_nr = VBAR_GET_PAGE_NR(mv, offset); page_nr < page_end; page_nr++) {
+        ResidentPage *rp = &mv->residency_map[page_nr];
+
+        if (!rp->handle || rp->populated_serial == rp->serial || rp->populating) {
+            continue;
+        }
+        rp->populating = job;
+        if (!vbar_populate_page(mv, page_nr, job)) {
+            log(ERROR, "%s: populate of page %zu failed\n", __func__, page_nr);
+            ret = false;
+            break;
+        }
+    }
+    mutex_unlock(mv->lock);
+    return ret;
+}
+
+/* Release the pages job claimed, populated if ok. Their copies are on stream,
+ * so each page gets a fence there for faults from other streams to wait on.
+ * Under the shared lock.
+ */
+static void populate_finish(ModelVBAR *mv, uint64_t offset, uint64_t size, VbarPopulate *job,
+                            cudaStream_t stream, bool ok) {
+    size_t page_end = MIN(VBAR_GET_PAGE_NR_UP(mv, offset + size), mv->nr_pages);
+
+    mutex_lock(mv->lock);
+    for (size_t page_nr = VBAR_GET_PAGE_NR(mv, offset); page_nr < page_end; page_nr++) {
+        ResidentPage *rp = &mv->residency_map[page_nr];
+
+        if (rp->populating == job) {
+            rp->populating = NULL;
+            if (ok) {
+                page_populate_record(rp, stream);
+                rp->populated_serial = rp->serial;
+            }
+        }
     }
+    mv->populate_gen++;
+    condvar_broadcast(mv->populate_cond);
+    mutex_unlock(mv->lock);
+}
+
+/* Queue the claimed copies on stream with no lock held, so other faults, the
+ * reclaimer and the allocator do not wait on the file reads, then release the
+ * pages. Returns whether anything was queued, or false on failure with *ok.
+ */
+static bool populate_run(ModelVBAR *mv, uint64_t offset, uint64_t size, VbarPopulate *job,
+                         cudaStream_t stream, bool *ok) {
+    bool populated = job->nr_copies > 0;
+
+    *ok = *ok && vbar_populate_issue(mv, job, stream);
+    vbars_lock_shared();
+    populate_finish(mv, offset, size, job, stream, *ok);
+    vbars_unlock_shared();
+    vbar_populate_release(job);
+    return populated;
+}
 
-    /* We got our allocation */
+/* Wait until no other populate holds pages of the range, so their copies are
+ * queued and fenced before the caller orders itself after them. Without
+ * vbars_lock, which the other populate needs to finish.
+ */
+static void populate_wait_others(ModelVBAR *mv, uint64_t offset, uint64_t size) {
+    size_t page_end = MIN(VBAR_GET_PAGE_NR_UP(mv, offset + size), mv->nr_pages);
+
+    for (;;) {
+        bool busy = false;
+        uint64_t gen;
+
+        vbars_lock_shared();
+        mutex_lock(mv->lock);
+        for (size_t page_nr = VBAR_GET_PAGE_NR(mv, offset); page_nr < page_end && !busy; page_nr++) {
+            busy = mv->residency_map[page_nr].populating != NULL;
+        }
+        gen = mv->populate_gen;
+        mutex_unlock(mv->lock);
+        vbars_unlock_shared();
+        if (!busy) {
+            return;
+        }
+
+        mutex_lock(mv->lock);
+        while (mv->populate_gen == gen) {
+            condvar_wait(mv->populate_cond, mv->lock);
+        }
+        mutex_unlock(mv->lock);
+    }
+}
 
-    for (uint64_t page_nr = VBAR_GET_PAGE_NR(offset); page_nr < page_end; page_nr++) {
+/* The hit path. Residency only changes under the exclusive lock, so with the
+ * shared lock held a range that is resident below the watermark stays that
+ * way. need_populated also requires every page of it to be populated.
+ */
+static bool range_resident(ModelVBAR *mv, uint64_t offset, uint64_t size, bool need_populated) {
+    size_t page_start = VBAR_GET_PAGE_NR(mv, offset);
+    size_t page_end = VBAR_GET_PAGE_NR_UP(mv, offset + size);
+
+    if (page_end > mv->watermark ||
+        bitmap_find_next_clear(mv->resident, page_start, page_end) != page_end) {
+        return false;
+    }
+    if (need_populated && (mv->nr_sources || mv->nr_writebacks)) {
+        for (size_t page_nr = page_start; page_nr < page_end; page_nr++) {
+            ResidentPage *rp = &mv->residency_map[page_nr];
+
+            if (rp->populated_serial != rp->serial) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* Order stream after the populates of the range, under mv->lock */
+static void range_populate_wait(ModelVBAR *mv, uint64_t offset, uint64_t size, cudaStream_t stream) {
+    size_t page_end = VBAR_GET_PAGE_NR_UP(mv, offset + size);
+
+    for (size_t page_nr = VBAR_GET_PAGE_NR(mv, offset); page_nr < page_end; page_nr++) {
+        page_populate_wait(&mv->residency_map[page_nr], stream);
+    }
+}
+
+/* fault_range() for a range_resident() range, under mv->lock */
+static void range_hit(ModelVBAR *mv, uint64_t offset, uint64_t size, uint32_t *signature, bool pin) {
+    size_t signature_index = 0;
+    size_t page_end = VBAR_GET_PAGE_NR_UP(mv, offset + size);
+
+    for (size_t page_nr = VBAR_GET_PAGE_NR(mv, offset); page_nr < page_end; page_nr++) {
         ResidentPage *rp = &mv->residency_map[page_nr];
-        rp->pin_count++;
+
+        vbar_page_touch(mv, rp, false);
+        signature[signature_index++] = rp->serial;
+    }
+    if (pin) {
+        pin_range(mv, offset, size);
     }
+}
+
+/* need_populated hits also order stream after the populates of the range */
+static bool fault_hit(ModelVBAR *mv, uint64_t offset, uint64_t size, uint32_t *signature,
+                      bool pin, bool need_populated, cudaStream_t stream) {
+    bool hit;
+
+    vbars_lock_shared();
+    mutex_lock(mv->lock);
+    hit = range_resident(mv, offset, size, need_populated);
+    if (hit) {
+        range_hit(mv, offset, size, signature, pin);
+        if (need_populated) {
+            range_populate_wait(mv, offset, size, stream);
+        }
+    }
+    mutex_unlock(mv->lock);
+    vbars_unlock_shared();
+    return hit;
+}
+
+/* The miss path of vbar_fault(), under the exclusive lock */
+static int fault_pinned(ModelVBAR *mv, uint64_t offset, uint64_t size, uint32_t *signature) {
+    int ret;
+
+    vbars_dirty = true;
+    vram_reclaim_kick();
+
+    /* Stopgap. If the we get a bad shared memory spike, collect it here on the next layer
+     * as the allocator is unreliable as it may not actually be called reliably when you
+     * really need to know you have spilled.
+     */
+    vbars_free_protected(budget_deficit(0), NULL, 0, VBAR_EVICT_ALLOCATOR);
+
+    ret = fault_range(mv, offset, size, signature, false, 0);
+    if (ret == VBAR_FAULT_SUCCESS && !range_resident(mv, offset, size, false)) {
+        /* Eviction for a later page took an earlier one */
+        log(DEBUG, "VBAR range lost pages while faulting\n");
+        ret = VBAR_FAULT_OOM;
+    }
+    if (ret == VBAR_FAULT_SUCCESS) {
+        /* We got our allocation */
+        pin_range(mv, offset, size);
+    }
+    return ret;
+}
+
+SHARED_EXPORT
+int vbar_fault(void *devctx, void *vbar, uint64_t offset, uint64_t size, uint32_t *signature) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    int ret;
+
+    set_devctx((AimdoContext *)devctx);
+
+    log(VVERBOSE, "%s (start): offset=%lldk, size=%lldk\n", __func__, (ull)(offset / K), (ull)(size / K));
+
+    /* A hit skips the stopgap below. Spikes wait for the next miss or allocation. */
+    if (fault_hit(mv, offset, size, signature, true, false, NULL)) {
+        log(VVERBOSE, "%s (return) hit\n", __func__);
+        return VBAR_FAULT_SUCCESS;
+    }
+
+    vbars_lock_exclusive();
+    ret = fault_pinned(mv, offset, size, signature);
+    vbars_unlock_exclusive();
 
     log(VVERBOSE, "%s (return) %d\n", __func__, ret);
     return ret;
 }
 
+/* Make as many leading pages of the range resident as the budget allows and pin
+ * them. *resident is the size of the pinned prefix, clamped to size, and is what
+ * the caller unpins. The rest of the range is left for the caller to stream from
+ * the host. VBAR_FAULT_OOM if not even the first page fits. The signature covers
+ * the resident pages only.
+ */
 SHARED_EXPORT
-void vbar_unpin(void *devctx, void *vbar, uint64_t offset, uint64_t size) {
+int vbar_fault_partial(void *devctx, void *vbar, uint64_t offset, uint64_t size,
+                       uint32_t *signature, uint64_t *resident) {
     ModelVBAR *mv = (ModelVBAR *)vbar;
+    size_t page_start = VBAR_GET_PAGE_NR(mv, offset);
+    size_t page_end = VBAR_GET_PAGE_NR_UP(mv, offset + size);
+    size_t done = page_start;
+    size_t pages_missing = 0;
+    int ret = VBAR_FAULT_SUCCESS;
 
     set_devctx((AimdoContext *)devctx);
 
     log(VVERBOSE, "%s (start): offset=%lldk, size=%lldk\n", __func__, (ull)(offset / K), (ull)(size / K));
+
+    *resident = 0;
+    if (fault_hit(mv, offset, size, signature, true, false, NULL)) {
+        *resident = size;
+        return VBAR_FAULT_SUCCESS;
+    }
+
+    vbars_lock_exclusive();
     vbars_dirty = true;
-    size_t page_end = VBAR_GET_PAGE_NR_UP(offset + size);
 
-    if (page_end > mv->watermark) {
-        CHECK_CU(cuCtxSynchronize());
+    vbars_free_protected(budget_deficit(0), NULL, 0, VBAR_EVICT_ALLOCATOR);
+
+    page_end = MIN(page_end, mv->watermark);
+    for (size_t page_nr = bitmap_find_next_clear(mv->resident, page_start, page_end);
+         page_nr < page_end; page_nr = bitmap_find_next_clear(mv->resident, page_nr + 1, page_end)) {
+        pages_missing++;
+    }
+    if (pages_missing) {
+        vbars_free_for_vbar(mv, page_start, page_end, fault_surplus(mv, pages_missing));
+    }
+
+    /* Page by page, so a page that does not fit ends the prefix rather than the fault */
+    for (; done < page_end && done < mv->watermark; done++) {
+        uint64_t page_offset = MAX(offset, (uint64_t)done * mv->page_size);
+
+        ret = fault_range(mv, page_offset, 1, &signature[done - page_start], true, 0);
+        if (ret != VBAR_FAULT_SUCCESS) {
+            break;
+        }
+    }
+    done = MIN(done, mv->watermark);
+    /* Only the prefix that is still resident, if a later page's eviction took an earlier one */
+    done = bitmap_find_next_clear(mv->resident, page_start, done);
+
+    /* On error, pages faulted so far stay resident but unpinned, as with vbar_fault() */
+    if (ret != VBAR_FAULT_ERROR) {
+        ret = done > page_start ? VBAR_FAULT_SUCCESS : VBAR_FAULT_OOM;
     }
+    if (ret == VBAR_FAULT_SUCCESS) {
+        *resident = MIN(size, (uint64_t)done * mv->page_size - offset);
+        pin_range(mv, offset, *resident);
+    }
+    vbars_unlock_exclusive();
+
+    log(VVERBOSE, "%s (return) %d, resident=%lldk\n", __func__, ret, (ull)(*resident / K));
+    return ret;
+}
 
-    for (uint64_t page_nr = VBAR_GET_PAGE_NR(offset); page_nr < page_end && page_nr < mv->nr_pages; page_nr++) {
+/* Fault [offset, offset + size) ahead of use, typically the next layer while the
+ * current one computes. Nothing is pinned. Pages with an attached source are
+ * populated on stream. Otherwise the signature is as for vbar_fault(), so pages
+ * whose serial changed are the ones that need a populate, which the caller
+ * queues on stream. Until a vbar_fault() uses them, freshly prefetched
+ * pages are the first to go under pressure and their eviction waits on stream.
+ */
+SHARED_EXPORT
+int vbar_prefetch(void *devctx, void *vbar, uint64_t offset, uint64_t size, cudaStream_t stream,
+                  uint32_t *signature) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    size_t page_end = VBAR_GET_PAGE_NR_UP(mv, offset + size);
+    VbarPopulate job = { 0 };
+    bool ok;
+    int ret;
+
+    set_devctx((AimdoContext *)devctx);
+
+    log(VVERBOSE, "%s (start): offset=%lldk, size=%lldk, stream=%p\n", __func__,
+        (ull)(offset / K), (ull)(size / K), (void *)stream);
+
+    if (fault_hit(mv, offset, size, signature, false, true, stream)) {
+        return VBAR_FAULT_SUCCESS;
+    }
+
+    vbars_lock_exclusive();
+    vbars_dirty = true;
+
+    vbars_free_protected(budget_deficit(0), NULL, 0, VBAR_EVICT_ALLOCATOR);
+
+    /* Claim the absent pages up front so pages handed over by page_transfer()
+     * are marked too. Claims that did not get memory are dropped after.
+     */
+    for (size_t page_nr = VBAR_GET_PAGE_NR(mv, offset); page_nr < page_end && page_nr < mv->nr_pages;
+         page_nr++) {
         ResidentPage *rp = &mv->residency_map[page_nr];
-        if (rp->pin_count) {
-            rp->pin_count--;
+
+        if (!rp->handle) {
+            vbar_page_prefetch(mv, page_nr, (CUstream)stream);
         }
-        mod1(mv, page_nr, page_nr >= mv->watermark, false);
     }
 
-    if (page_end > mv->watermark) {
-        CHECK_CU(cuCtxSynchronize());
+    ret = fault_range(mv, offset, size, signature, false, 0);
+    ok = ret == VBAR_FAULT_SUCCESS && populate_claim(mv, offset, size, &job);
+
+    for (size_t page_nr = VBAR_GET_PAGE_NR(mv, offset); page_nr < page_end && page_nr < mv->nr_pages;
+         page_nr++) {
+        ResidentPage *rp = &mv->residency_map[page_nr];
+
+        if (!rp->handle) {
+            rp->prefetched = false;
+        }
+    }
+    vbars_unlock_exclusive();
+
+    populate_run(mv, offset, size, &job, stream, &ok);
+    if (ret == VBAR_FAULT_SUCCESS && !ok) {
+        ret = VBAR_FAULT_ERROR;
+    }
+
+    log(VVERBOSE, "%s (return) %d\n", __func__, ret);
+    return ret;
+}
+
+/* vbar_fault() for a range that did not fit in VRAM. Pages without VRAM are
+ * backed by pinned host memory mapped at the same addresses (see
+ * vbar_set_host_fallback()), so kernels read them over the bus in place
+ * instead of from a temporary copy. Host pages stay mapped after unpinning
+ * and keep their serials, so they are only populated once. VBAR_FAULT_OOM
+ * once the host limit is reached.
+ */
+SHARED_EXPORT
+int vbar_fault_host(void *devctx, void *vbar, uint64_t offset, uint64_t size, uint32_t *signature) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    size_t signature_index = 0;
+    size_t page_end = VBAR_GET_PAGE_NR_UP(mv, offset + size);
+    int ret = VBAR_FAULT_SUCCESS;
+
+    set_devctx((AimdoContext *)devctx);
+
+    log(VVERBOSE, "%s (start): offset=%lldk, size=%lldk\n", __func__, (ull)(offset / K), (ull)(size / K));
+
+    if (page_end > mv->nr_pages) {
+        log(ERROR, "%s: range is past the end of the VBAR\n", __func__);
+        return VBAR_FAULT_ERROR;
+    }
+
+    vbars_lock_exclusive();
+    for (size_t page_nr = VBAR_GET_PAGE_NR(mv, offset); page_nr < page_end; page_nr++) {
+        ResidentPage *rp = &mv->residency_map[page_nr];
+        CUresult err;
+
+        if (rp->handle) {
+            vbar_page_touch(mv, rp, false);
+        } else if (!rp->host_handle) {
+            if (mv->host_pages >= mv->host_pages_limit) {
+                log(DEBUG, "%s: host page limit %zu reached\n", __func__, mv->host_pages_limit);
+                ret = VBAR_FAULT_OOM;
+                break;
+            }
+            if ((err = page_map_host(mv, page_nr)) != CUDA_SUCCESS) {
+                ret = err == CUDA_ERROR_OUT_OF_MEMORY ? VBAR_FAULT_OOM : VBAR_FAULT_ERROR;
+                break;
+            }
+        }
+        signature[signature_index++] = rp->serial;
+    }
+    if (ret == VBAR_FAULT_SUCCESS) {
+        pin_range(mv, offset, size);
+    }
+    vbars_unlock_exclusive();
+
+    log(VVERBOSE, "%s (return) %d\n", __func__, ret);
+    return ret;
+}
+
+/* Add dst page dst_nr as a read-only holder of src page src_nr */
+static bool page_share(ModelVBAR *src, size_t src_nr, ModelVBAR *dst, size_t dst_nr) {
+    ResidentPage *from = &src->residency_map[src_nr];
+    ResidentPage *to = &dst->residency_map[dst_nr];
+    CUdeviceptr vaddr = dst->vbar + dst_nr * dst->page_size;
+    VbarShare *share = from->share;
+
+    CUmemAccessDesc accessDesc = {
+        .location.type = CU_MEM_LOCATION_TYPE_DEVICE,
+        .location.id = dst->device,
+        .flags = CU_MEM_ACCESS_FLAGS_PROT_READ,
+    };
+
+    if (!share) {
+        if (!(share = (VbarShare *)calloc(1, sizeof(*share)))) {
+            return false;
+        }
+        share->handle = from->handle;
+    }
+    if (share->nr_holders + 2 > share->holders_cap) {
+        size_t cap = share->holders_cap ? share->holders_cap * 2 : 4;
+        VbarShareHolder *holders = (VbarShareHolder *)realloc(share->holders, cap * sizeof(*holders));
+
+        if (!holders) {
+            goto fail;
+        }
+        share->holders = holders;
+        share->holders_cap = cap;
+    }
+
+    if (!CHECK_CU(cuMemMap(vaddr, dst->page_size, 0, share->handle, 0))) {
+        goto fail;
+    }
+    if (!CHECK_CU(cuMemSetAccess(vaddr, dst->page_size, &accessDesc, 1))) {
+        CHECK_CU(cuMemUnmap(vaddr, dst->page_size));
+        unmap_workaround(vaddr, dst->page_size);
+        goto fail;
+    }
+
+    if (!from->share) {
+        share->holders[share->nr_holders].mv = src;
+        share->holders[share->nr_holders++].page_nr = src_nr;
+        from->share = share;
+    }
+    share->holders[share->nr_holders].mv = dst;
+    share->holders[share->nr_holders++].page_nr = dst_nr;
+    to->handle = share->handle;
+    to->share = share;
+    to->serial = from->serial;
+    to->populated_serial = from->populated_serial;
+    /* dst faults do not know the stream the contents are still arriving on */
+    if (from->populate_pending) {
+        CHECK_CU(cuEventSynchronize(from->populate_fence));
+        from->populate_pending = false;
+    }
+    vbar_page_touch(dst, to, true);
+    vbar_page_resident(dst, dst_nr);
+    return true;
+
+fail:
+    if (!from->share) {
+        share_free(share);
+    }
+    return false;
+}
+
+/* Map the resident pages of src [src_offset, src_offset + size) read-only into
+ * dst at dst_offset instead of loading a second copy, for VBARs holding the
+ * same weights. Offsets must sit at the same place within a page, and both
+ * VBARs must have the same page size. The signature is dst's, as for
+ * vbar_fault(), and carries src's serials so an unchanged weight needs no
+ * populate. Nothing is pinned. Pages that are absent, dirty, part of a run or
+ * written through vbar_fault_write() in src stay absent in dst, which is
+ * VBAR_FAULT_OOM. dst must not write to them.
+ */
+SHARED_EXPORT
+int vbar_share(void *devctx, void *dst_vbar, uint64_t dst_offset, void *src_vbar, uint64_t src_offset,
+               uint64_t size, uint32_t *signature) {
+    ModelVBAR *dst = (ModelVBAR *)dst_vbar;
+    ModelVBAR *src = (ModelVBAR *)src_vbar;
+    size_t dst_nr = VBAR_GET_PAGE_NR(dst, dst_offset);
+    size_t page_end;
+    int ret = VBAR_FAULT_SUCCESS;
+
+    set_devctx((AimdoContext *)devctx);
+
+    log(VVERBOSE, "%s (start): dst=%p+%lldk src=%p+%lldk size=%lldk\n", __func__, dst_vbar,
+        (ull)(dst_offset / K), src_vbar, (ull)(src_offset / K), (ull)(size / K));
+
+    if (dst == src || dst->page_size != src->page_size || dst->device != src->device ||
+        dst_offset % dst->page_size != src_offset % src->page_size ||
+        src_offset + size > (uint64_t)src->nr_pages * src->page_size ||
+        dst_offset + size > (uint64_t)dst->nr_pages * dst->page_size) {
+        log(ERROR, "%s: ranges do not line up\n", __func__);
+        return VBAR_FAULT_ERROR;
+    }
+
+    vbars_lock_exclusive();
+    vbars_dirty = true;
+    page_end = VBAR_GET_PAGE_NR_UP(src, src_offset + size);
+    for (size_t src_nr = VBAR_GET_PAGE_NR(src, src_offset); src_nr < page_end; src_nr++, dst_nr++) {
+        ResidentPage *from = &src->residency_map[src_nr];
+        ResidentPage *to = &dst->residency_map[dst_nr];
+
+        /* A resident dst page is already shared or has a copy of its own */
+        if (!to->handle) {
+            if (!from->handle || from->run_pages || from->dirty || from->written_back || from->overlay ||
+                to->host_handle || dst_nr >= dst->watermark) {
+                ret = VBAR_FAULT_OOM;
+            } else if (!page_share(src, src_nr, dst, dst_nr)) {
+                ret = VBAR_FAULT_ERROR;
+                break;
+            } else {
+                log(VERBOSE, "VBAR %p page %zu shared into VBAR %p page %zu\n", src_vbar, src_nr,
+                    dst_vbar, dst_nr);
+            }
+        }
+        signature[src_nr - VBAR_GET_PAGE_NR(src, src_offset)] = to->serial;
+    }
+    vbars_unlock_exclusive();
+
+    log(VVERBOSE, "%s (return) %d\n", __func__, ret);
+    return ret;
+}
+
+/* A VBAR with the same layout and sources as base, whose pages start out as
+ * read-only mappings of base's resident ones. For an overlay such as a LoRA
+ * that only changes some weights: the rest cost no VRAM or loading, and
+ * vbar_fault_write() gives a page a private copy before it is changed.
+ */
+SHARED_EXPORT
+void *vbar_clone(void *devctx, void *base) {
+    ModelVBAR *src = (ModelVBAR *)base;
+    ModelVBAR *mv;
+    size_t shared = 0;
+
+    set_devctx((AimdoContext *)devctx);
+
+    if (!(mv = (ModelVBAR *)vbar_allocate(devctx, (uint64_t)src->nr_pages * src->page_size,
+                                          src->device, src->page_size))) {
+        return NULL;
+    }
+
+    vbars_lock_exclusive();
+    if (!vbar_sources_copy(mv, src)) {
+        vbars_unlock_exclusive();
+        vbar_free(devctx, mv);
+        return NULL;
+    }
+    mv->reload_bw = src->reload_bw;
+    mv->weight = src->weight;
+    for (size_t page_nr = 0; page_nr < mv->nr_pages; page_nr++) {
+        ResidentPage *from = &src->residency_map[page_nr];
+
+        mv->residency_map[page_nr].reload_bw = from->reload_bw;
+        if (!from->handle || from->run_pages || from->dirty || from->written_back || from->overlay ||
+            page_nr >= mv->watermark) {
+            continue;
+        }
+        if (!page_share(src, page_nr, mv, page_nr)) {
+            log(DEBUG, "%s: could not share page %zu, it faults on its own\n", __func__, page_nr);
+            continue;
+        }
+        shared++;
+    }
+    vbars_dirty = true;
+    vbars_unlock_exclusive();
+
+    log(DEBUG, "%s: vbar=%p base=%p, %zu pages shared\n", __func__, (void *)mv, base, shared);
+    return mv;
+}
+
+/* Give shared page page_nr its own VRAM, with a copy of the shared contents
+ * queued on stream. The serial is new, so signatures taken before the write
+ * no longer match.
+ */
+static int page_privatize(ModelVBAR *mv, size_t page_nr, size_t page_end, cudaStream_t stream) {
+    ResidentPage *rp = &mv->residency_map[page_nr];
+    CUdeviceptr vaddr = mv->vbar + page_nr * mv->page_size;
+    VbarShare *share = rp->share;
+    ResidentPage *from = NULL;
+    CUdeviceptr from_vaddr = 0;
+    bool populated;
+    CUresult err;
+
+    if (rp->pin_count || rp->graph_locks) {
+        log(DEBUG, "VBAR page %zu is pinned while shared\n", page_nr);
+        return VBAR_FAULT_OOM;
+    }
+
+    if (!vrampool_available(mv->page_size) && budget_deficit(mv->page_size) > 0) {
+        vbars_free_protected(mv->page_size, mv, page_end, VBAR_EVICT_FAULT);
+        if (page_end > mv->watermark) {
+            return VBAR_FAULT_OOM;
+        }
+        if (!(share = rp->share)) {
+            /* Evicted along with the other holders, it faults as a private page */
+            return VBAR_FAULT_SUCCESS;
+        }
+    }
+
+    for (size_t i = 0; i < share->nr_holders; i++) {
+        if (share->holders[i].mv != mv || share->holders[i].page_nr != page_nr) {
+            ModelVBAR *other = share->holders[i].mv;
+
+            from = &other->residency_map[share->holders[i].page_nr];
+            from_vaddr = other->vbar + share->holders[i].page_nr * other->page_size;
+            break;
+        }
+    }
+    populated = from->populated_serial == from->serial;
+    /* Whatever last wrote the shared page must be done before the copy reads it */
+    page_fence_wait(from);
+
+    share_drop(mv, page_nr, VBAR_EVICT_NONE);
+    if ((err = three_stooges(vaddr, mv->page_size, mv->device, &rp->handle)) != CUDA_SUCCESS) {
+        rp->handle = 0;
+        return err == CUDA_ERROR_OUT_OF_MEMORY ? VBAR_FAULT_OOM : VBAR_FAULT_ERROR;
+    }
+    vbar_page_touch(mv, rp, true);
+    rp->serial = ++vbar_serial;
+    rp->populated_serial = populated ? rp->serial : 0;
+    vbar_page_resident(mv, page_nr);
+
+    if (!CHECK_CU(cuMemcpyDtoDAsync(vaddr, from_vaddr, mv->page_size, (CUstream)stream))) {
+        return VBAR_FAULT_ERROR;
+    }
+    /* Neither page goes away before the copy is done */
+    page_fence_record(from, stream);
+    page_fence_record(rp, stream);
+    if (populated) {
+        page_populate_record(rp, stream);
+    }
+    log(VERBOSE, "VBAR %p page %zu made private\n", (void *)mv, page_nr);
+    return VBAR_FAULT_SUCCESS;
+}
+
+/* vbar_fault() for a range the caller is about to write to. Pages shared with
+ * another VBAR (see vbar_clone()) get a private copy first, queued on stream,
+ * which the caller's writes must be ordered after. The pages are not
+ * orphaned or shared on from then on, as they no longer match their sources.
+ */
+SHARED_EXPORT
+int vbar_fault_write(void *devctx, void *vbar, uint64_t offset, uint64_t size, cudaStream_t stream,
+                     uint32_t *signature) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    size_t page_end = VBAR_GET_PAGE_NR_UP(mv, offset + size);
+    int ret = VBAR_FAULT_SUCCESS;
+
+    set_devctx((AimdoContext *)devctx);
+
+    log(VVERBOSE, "%s (start): offset=%lldk, size=%lldk, stream=%p\n", __func__,
+        (ull)(offset / K), (ull)(size / K), (void *)stream);
+
+    if (page_end > mv->nr_pages) {
+        log(ERROR, "%s: range is past the end of the VBAR\n", __func__);
+        return VBAR_FAULT_ERROR;
+    }
+
+    vbars_lock_exclusive();
+    vbars_dirty = true;
+    for (size_t page_nr = VBAR_GET_PAGE_NR(mv, offset); page_nr < page_end && page_nr < mv->watermark &&
+         ret == VBAR_FAULT_SUCCESS; page_nr++) {
+        if (mv->residency_map[page_nr].share) {
+            ret = page_privatize(mv, page_nr, page_end, stream);
+        }
+    }
+    if (ret == VBAR_FAULT_SUCCESS) {
+        ret = fault_pinned(mv, offset, size, signature);
+    }
+    if (ret == VBAR_FAULT_SUCCESS) {
+        for (size_t page_nr = VBAR_GET_PAGE_NR(mv, offset); page_nr < page_end; page_nr++) {
+            mv->residency_map[page_nr].overlay = true;
+        }
+    }
+    vbars_unlock_exclusive();
+
+    log(VVERBOSE, "%s (return) %d\n", __func__, ret);
+    return ret;
+}
+
+static bool fault_many_hit(ModelVBAR *mv, const uint64_t *offsets, const uint64_t *sizes,
+                           size_t n, uint32_t **signatures, int *results) {
+    bool hit = true;
+
+    vbars_lock_shared();
+    mutex_lock(mv->lock);
+    for (size_t i = 0; i < n && hit; i++) {
+        hit = range_resident(mv, offsets[i], sizes[i], false);
+    }
+    for (size_t i = 0; i < n && hit; i++) {
+        range_hit(mv, offsets[i], sizes[i], signatures[i], true);
+        results[i] = VBAR_FAULT_SUCCESS;
+    }
+    mutex_unlock(mv->lock);
+    vbars_unlock_shared();
+    return hit;
+}
+
+typedef struct VbarBatchRange {
+    size_t page_start;
+    size_t page_end;
+    size_t i;
+} VbarBatchRange;
+
+static int batch_range_cmp(const void *a, const void *b) {
+    const VbarBatchRange *x = (const VbarBatchRange *)a;
+    const VbarBatchRange *y = (const VbarBatchRange *)b;
+
+    return x->page_start < y->page_start ? -1 : x->page_start > y->page_start;
+}
+
+/* Fault a batch of ranges (typically all the weights of one block) with a single
+ * budget poll and a single eviction pass sized for the whole batch. Each range
+ * gets its own result and signature buffer, sized as for vbar_fault(). Ranges
+ * may come in any order and overlap. Eviction leaves the whole batch alone, and
+ * ranges are pinned together at the end, so a range that still lost pages (to
+ * a watermark drop) is reported as VBAR_FAULT_OOM.
+ */
+SHARED_EXPORT
+void vbar_fault_many(void *devctx, void *vbar, const uint64_t *offsets, const uint64_t *sizes,
+                     size_t n, uint32_t **signatures, int *results) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    VbarBatchRange *ranges;
+    size_t nr_ranges = 0;
+    size_t first = SIZE_MAX;
+    size_t target = 0;
+    size_t pages_missing = 0;
+    size_t counted_end = 0;
+
+    set_devctx((AimdoContext *)devctx);
+
+    log(VVERBOSE, "%s (start): n=%zu\n", __func__, n);
+
+    for (size_t i = 0; i < n; i++) {
+        if (VBAR_GET_PAGE_NR_UP(mv, offsets[i] + sizes[i]) > mv->nr_pages) {
+            log(ERROR, "%s: range %zu is outside the VBAR\n", __func__, i);
+            for (i = 0; i < n; i++) {
+                results[i] = VBAR_FAULT_ERROR;
+            }
+            return;
+        }
+    }
+
+    if (fault_many_hit(mv, offsets, sizes, n, signatures, results)) {
+        return;
+    }
+
+    if (!(ranges = (VbarBatchRange *)malloc(MAX(n, 1) * sizeof(*ranges)))) {
+        log(CRITICAL, "Host OOM\n");
+        for (size_t i = 0; i < n; i++) {
+            results[i] = VBAR_FAULT_ERROR;
+        }
+        return;
+    }
+
+    vbars_lock_exclusive();
+    vbars_dirty = true;
+
+    vbars_free_protected(budget_deficit(0), NULL, 0, VBAR_EVICT_ALLOCATOR);
+
+    /* In page order, so pages shared by several ranges are counted once */
+    for (size_t i = 0; i < n; i++) {
+        ranges[i].page_start = VBAR_GET_PAGE_NR(mv, offsets[i]);
+        ranges[i].page_end = VBAR_GET_PAGE_NR_UP(mv, offsets[i] + sizes[i]);
+        ranges[i].i = i;
+        results[i] = VBAR_FAULT_OOM;
+    }
+    qsort(ranges, n, sizeof(*ranges), batch_range_cmp);
+
+    for (size_t r = 0; r < n; r++) {
+        if (ranges[r].page_end > mv->watermark) {
+            continue;
+        }
+        ranges[nr_ranges++] = ranges[r];
+        target = MAX(target, ranges[r].page_end);
+        for (size_t page_nr = MAX(ranges[r].page_start, counted_end); page_nr < ranges[r].page_end;
+             page_nr++) {
+            if (!mv->residency_map[page_nr].handle) {
+                first = MIN(first, page_nr);
+                pages_missing++;
+            }
+        }
+        counted_end = MAX(counted_end, ranges[r].page_end);
+    }
+
+    if (pages_missing) {
+        vbars_free_for_vbar(mv, first, target, fault_surplus(mv, pages_missing));
+    }
+
+    for (size_t r = 0; r < nr_ranges; r++) {
+        size_t i = ranges[r].i;
+
+        results[i] = fault_range(mv, offsets[i], sizes[i], signatures[i], true, target);
+    }
+
+    for (size_t r = 0; r < nr_ranges; r++) {
+        size_t i = ranges[r].i;
+
+        if (results[i] != VBAR_FAULT_SUCCESS) {
+            continue;
+        }
+        if (!range_resident(mv, offsets[i], sizes[i], false)) {
+            log(DEBUG, "VBAR batch range %zu lost pages to a later range\n", i);
+            results[i] = VBAR_FAULT_OOM;
+            continue;
+        }
+        pin_range(mv, offsets[i], sizes[i]);
+    }
+    vbars_unlock_exclusive();
+    free(ranges);
+
+    log(VVERBOSE, "%s (return)\n", __func__);
+}
+
+/* stream is the last stream to use the range. Eviction of these pages waits
+ * on work queued there up to this point, so it must be ordered after every use.
+ * Returns true if that left resident pages above the watermark to free.
+ */
+static bool unpin_range(ModelVBAR *mv, uint64_t offset, uint64_t size, cudaStream_t stream) {
+    size_t page_end = VBAR_GET_PAGE_NR_UP(mv, offset + size);
+    bool stranded = false;
+
+    for (uint64_t page_nr = VBAR_GET_PAGE_NR(mv, offset); page_nr < page_end && page_nr < mv->nr_pages; page_nr++) {
+        ResidentPage *rp = &mv->residency_map[page_nr];
+        if (rp->pin_count && !--rp->pin_count && (rp->handle || rp->host_handle)) {
+            page_fence_record(rp, stream);
+        }
+        stranded |= page_nr >= mv->watermark && rp->handle && !rp->pin_count && !rp->graph_locks;
+    }
+    return stranded;
+}
+
+/* Free what unpin_range() left above the watermark, under the exclusive lock */
+static void free_stranded(ModelVBAR *mv, uint64_t offset, uint64_t size) {
+    size_t page_end = VBAR_GET_PAGE_NR_UP(mv, offset + size);
+
+    for (uint64_t page_nr = MAX(VBAR_GET_PAGE_NR(mv, offset), mv->watermark);
+         page_nr < page_end && page_nr < mv->nr_pages; page_nr++) {
+        mod1(mv, page_nr, true, false, VBAR_EVICT_WATERMARK);
+    }
+}
+
+SHARED_EXPORT
+void vbar_unpin(void *devctx, void *vbar, uint64_t offset, uint64_t size, cudaStream_t stream) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    bool stranded;
+
+    set_devctx((AimdoContext *)devctx);
+
+    log(VVERBOSE, "%s (start): offset=%lldk, size=%lldk, stream=%p\n", __func__,
+        (ull)(offset / K), (ull)(size / K), (void *)stream);
+
+    vbars_lock_shared();
+    mutex_lock(mv->lock);
+    stranded = unpin_range(mv, offset, size, stream);
+    mutex_unlock(mv->lock);
+    vbars_unlock_shared();
+
+    if (stranded) {
+        vbars_lock_exclusive();
+        vbars_dirty = true;
+        free_stranded(mv, offset, size);
+        vbars_unlock_exclusive();
+    }
+}
+
+SHARED_EXPORT
+void vbar_unpin_many(void *devctx, void *vbar, const uint64_t *offsets, const uint64_t *sizes,
+                     size_t n, cudaStream_t stream) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    bool stranded = false;
+
+    set_devctx((AimdoContext *)devctx);
+
+    log(VVERBOSE, "%s (start): n=%zu, stream=%p\n", __func__, n, (void *)stream);
+
+    vbars_lock_shared();
+    mutex_lock(mv->lock);
+    for (size_t i = 0; i < n; i++) {
+        stranded |= unpin_range(mv, offsets[i], sizes[i], stream);
+    }
+    mutex_unlock(mv->lock);
+    vbars_unlock_shared();
+
+    if (stranded) {
+        vbars_lock_exclusive();
+        vbars_dirty = true;
+        for (size_t i = 0; i < n; i++) {
+            free_stranded(mv, offsets[i], sizes[i]);
+        }
+        vbars_unlock_exclusive();
+    }
+}
+
+/* vbar_fault() that also populates the faulted pages from the attached sources
+ * on stream, overlapping the reads for several pages. Pages another stream
+ * populated (a prefetch, or another thread's fault of the same weights) are
+ * waited for on stream, so the range is ready to use on stream on success.
+ * VBAR_FAULT_ERROR if a populate of the range failed. Pages without a source
+ * are left to the application and the signature works as for vbar_fault().
+ */
+SHARED_EXPORT
+int vbar_fault_populate(void *devctx, void *vbar, uint64_t offset, uint64_t size,
+                        cudaStream_t stream, uint32_t *signature) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    VbarPopulate job = { 0 };
+    bool ok;
+    int ret;
+
+    set_devctx((AimdoContext *)devctx);
+
+    if (fault_hit(mv, offset, size, signature, true, true, stream)) {
+        return VBAR_FAULT_SUCCESS;
+    }
+
+    vbars_lock_exclusive();
+    ret = fault_pinned(mv, offset, size, signature);
+    ok = ret == VBAR_FAULT_SUCCESS && populate_claim(mv, offset, size, &job);
+    vbars_unlock_exclusive();
+
+    /* The range is pinned, so it stays put while the copies are queued */
+    populate_run(mv, offset, size, &job, stream, &ok);
+    if (ret != VBAR_FAULT_SUCCESS) {
+        return ret;
+    }
+    if (ok) {
+        populate_wait_others(mv, offset, size);
+        vbars_lock_shared();
+        mutex_lock(mv->lock);
+        /* A populate of another thread that failed leaves its pages unpopulated */
+        ok = range_resident(mv, offset, size, true);
+        if (ok) {
+            range_populate_wait(mv, offset, size, stream);
+        }
+        mutex_unlock(mv->lock);
+        vbars_unlock_shared();
+    }
+    if (!ok) {
+        log(ERROR, "%s: populate of the range failed\n", __func__);
+        vbar_unpin(devctx, vbar, offset, size, stream);
+        return VBAR_FAULT_ERROR;
+    }
+    return ret;
+}
+
+/* Make stream wait for every populate of this VBAR that may still be in
+ * flight, e.g. after vbar_prefetch() on another stream.
+ */
+SHARED_EXPORT
+void vbar_populate_wait(void *devctx, void *vbar, cudaStream_t stream) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+
+    set_devctx((AimdoContext *)devctx);
+    vbars_lock_shared();
+    mutex_lock(mv->lock);
+    range_populate_wait(mv, 0, (uint64_t)mv->nr_pages * mv->page_size, stream);
+    mutex_unlock(mv->lock);
+    vbars_unlock_shared();
+}
+
+/* The resident pages of [offset, offset + size) were modified on stream after
+ * being populated, e.g. by a LoRA merge. Eviction saves them to the write-back
+ * regions (vbar_attach_writeback()) once stream is done with them, and
+ * populating restores them from there instead of from the sources.
+ */
+SHARED_EXPORT
+void vbar_mark_dirty(void *devctx, void *vbar, uint64_t offset, uint64_t size, cudaStream_t stream) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    size_t page_end = VBAR_GET_PAGE_NR_UP(mv, offset + size);
+
+    set_devctx((AimdoContext *)devctx);
+
+    log(VVERBOSE, "%s: offset=%lldk, size=%lldk, stream=%p\n", __func__,
+        (ull)(offset / K), (ull)(size / K), (void *)stream);
+
+    vbars_lock_shared();
+    mutex_lock(mv->lock);
+    for (size_t page_nr = VBAR_GET_PAGE_NR(mv, offset); page_nr < page_end && page_nr < mv->nr_pages;
+         page_nr++) {
+        ResidentPage *rp = &mv->residency_map[page_nr];
+
+        if (!rp->handle || rp->share) {
+            log(DEBUG, "%s: page %zu is not resident or is shared\n", __func__, page_nr);
+            continue;
+        }
+        rp->dirty = true;
+        page_fence_record(rp, stream);
+    }
+    mutex_unlock(mv->lock);
+    vbars_unlock_shared();
+}
+
+/* Drop any saved or pending modifications of [offset, offset + size), e.g.
+ * when a LoRA is removed. Pages populate from their sources again.
+ */
+SHARED_EXPORT
+void vbar_forget_writeback(void *devctx, void *vbar, uint64_t offset, uint64_t size) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    size_t page_end = VBAR_GET_PAGE_NR_UP(mv, offset + size);
+
+    set_devctx((AimdoContext *)devctx);
+
+    log(VERBOSE, "%s: offset=%lldk, size=%lldk\n", __func__, (ull)(offset / K), (ull)(size / K));
+
+    vbars_lock_exclusive();
+    for (size_t page_nr = VBAR_GET_PAGE_NR(mv, offset); page_nr < page_end && page_nr < mv->nr_pages;
+         page_nr++) {
+        mv->residency_map[page_nr].dirty = false;
+        mv->residency_map[page_nr].written_back = false;
+    }
+    vbars_unlock_exclusive();
+}
+
+typedef struct VbarGraphRange {
+    ModelVBAR *mv;
+    uint64_t offset;
+    uint64_t size;
+} VbarGraphRange;
+
+typedef struct VbarGraphLock {
+    struct VbarGraphLock *next; /* In vbar_graph_locks */
+    size_t n;
+    VbarGraphRange ranges[1]; /* Must be last! */
+} VbarGraphLock;
+
+static void graph_lock_range(ModelVBAR *mv, uint64_t offset, uint64_t size, bool lock) {
+    size_t page_end = VBAR_GET_PAGE_NR_UP(mv, offset + size);
+
+    for (size_t page_nr = VBAR_GET_PAGE_NR(mv, offset); page_nr < page_end; page_nr++) {
+        ResidentPage *rp = &mv->residency_map[page_nr];
+
+        if (lock) {
+            rp->graph_locks++;
+            rp->prefetched = false;
+        } else if (rp->graph_locks) {
+            rp->graph_locks--;
+        }
+    }
+    if (lock) {
+        mv->locked_end = MAX(mv->locked_end, page_end);
+    }
+    while (mv->locked_end && !mv->residency_map[mv->locked_end - 1].graph_locks) {
+        mv->locked_end--;
+    }
+}
+
+/* Make the ranges resident and hold them at their addresses until
+ * vbar_graph_unlock(), so a captured CUDA graph can replay against them. Held
+ * pages are not evicted, watermarks do not drop past them and vbar_unpin() does
+ * not free them. Contents are up to the caller as usual, e.g. fault and populate
+ * before capture. Returns the token, or NULL with nothing held if a range could
+ * not be made resident. Unlock before freeing any of the VBARs. A VBAR freed
+ * anyway is dropped from the token.
+ */
+SHARED_EXPORT
+void *vbar_graph_lock(void *devctx, void **vbars, const uint64_t *offsets, const uint64_t *sizes,
+                      size_t n) {
+    VbarGraphLock *lock;
+    uint32_t *signature;
+    size_t max_pages = 0;
+    size_t i;
+
+    set_devctx((AimdoContext *)devctx);
+
+    log(DEBUG, "%s: n=%zu\n", __func__, n);
+    for (i = 0; i < n; i++) {
+        ModelVBAR *mv = (ModelVBAR *)vbars[i];
+
+        max_pages = MAX(max_pages, VBAR_GET_PAGE_NR_UP(mv, offsets[i] + sizes[i]) -
+                                   VBAR_GET_PAGE_NR(mv, offsets[i]));
+    }
+    lock = (VbarGraphLock *)calloc(1, sizeof(*lock) + n * sizeof(lock->ranges[0]));
+    signature = (uint32_t *)malloc(MAX(max_pages, 1) * sizeof(*signature));
+    if (!lock || !signature) {
+        log(CRITICAL, "Host OOM\n");
+        free(signature);
+        free(lock);
+        return NULL;
+    }
+
+    vbars_lock_exclusive();
+    vbars_dirty = true;
+
+    vbars_free_protected(budget_deficit(0), NULL, 0, VBAR_EVICT_ALLOCATOR);
+
+    for (i = 0; i < n; i++) {
+        VbarGraphRange *range = &lock->ranges[i];
+
+        range->mv = (ModelVBAR *)vbars[i];
+        range->offset = offsets[i];
+        range->size = sizes[i];
+        if (fault_range(range->mv, range->offset, range->size, signature, false, 0) != VBAR_FAULT_SUCCESS) {
+            break;
+        }
+        graph_lock_range(range->mv, range->offset, range->size, true);
     }
+    if (i < n) {
+        log(WARNING, "%s: range %zu could not be made resident\n", __func__, i);
+        while (i--) {
+            graph_lock_range(lock->ranges[i].mv, lock->ranges[i].offset, lock->ranges[i].size, false);
+        }
+        free(lock);
+        lock = NULL;
+    } else {
+        lock->n = n;
+        lock->next = (VbarGraphLock *)vbar_graph_locks;
+        vbar_graph_locks = lock;
+    }
+    vbars_unlock_exclusive();
+
+    free(signature);
+    return lock;
+}
 
+/* stream is the last stream to replay the graph. Eviction of the released
+ * pages waits on it, as for vbar_unpin().
+ */
+SHARED_EXPORT
+void vbar_graph_unlock(void *devctx, void *token, cudaStream_t stream) {
+    VbarGraphLock *lock = (VbarGraphLock *)token;
+
+    set_devctx((AimdoContext *)devctx);
+
+    if (!lock) {
+        return;
+    }
+    log(DEBUG, "%s: n=%zu, stream=%p\n", __func__, lock->n, (void *)stream);
+    vbars_lock_exclusive();
+    vbars_dirty = true;
+    for (VbarGraphLock **i = (VbarGraphLock **)&vbar_graph_locks; *i; i = &(*i)->next) {
+        if (*i == lock) {
+            *i = lock->next;
+            break;
+        }
+    }
+    for (size_t i = 0; i < lock->n; i++) {
+        VbarGraphRange *range = &lock->ranges[i];
+        size_t page_end;
+
+        if (!range->mv) {
+            continue;
+        }
+        page_end = VBAR_GET_PAGE_NR_UP(range->mv, range->offset + range->size);
+        for (size_t page_nr = VBAR_GET_PAGE_NR(range->mv, range->offset); page_nr < page_end; page_nr++) {
+            ResidentPage *rp = &range->mv->residency_map[page_nr];
+
+            if (rp->graph_locks == 1 && rp->handle) {
+                page_fence_record(rp, stream);
+            }
+        }
+        graph_lock_range(range->mv, range->offset, range->size, false);
+    }
+    vbars_unlock_exclusive();
+    free(lock);
+}
+
+/* vbar_free() of a VBAR some tokens still hold. Its ranges are released and
+ * left out of the later vbar_graph_unlock().
+ */
+static void graph_locks_drop_vbar(ModelVBAR *mv) {
+    for (VbarGraphLock *lock = (VbarGraphLock *)vbar_graph_locks; lock; lock = lock->next) {
+        for (size_t i = 0; i < lock->n; i++) {
+            if (lock->ranges[i].mv == mv) {
+                graph_lock_range(mv, lock->ranges[i].offset, lock->ranges[i].size, false);
+                lock->ranges[i].mv = NULL;
+            }
+        }
+    }
+}
+
+/* Hand a populated, keyed page of a VBAR being freed to the orphan cache. A
+ * prefetched page the application may never have populated does not qualify.
+ */
+static bool page_orphan(ModelVBAR *mv, size_t page_nr) {
+    ResidentPage *rp = &mv->residency_map[page_nr];
+    CUdeviceptr vaddr = mv->vbar + page_nr * mv->page_size;
+    uint64_t key;
+
+    if (!vram_orphan_limit || !rp->handle || rp->run_pages || rp->share || rp->dirty || rp->written_back ||
+        rp->overlay ||
+        (rp->prefetched && rp->populated_serial != rp->serial) ||
+        !(key = vbar_page_key(mv, page_nr))) {
+        return false;
+    }
+    CHECK_CU(cuMemUnmap(vaddr, mv->page_size));
+    unmap_workaround(vaddr, mv->page_size);
+    vrampool_orphan(rp->handle, mv->page_size, key, rp->serial);
+    rp->handle = 0;
+    rp->prefetched = false;
+    vbar_page_absent(mv, page_nr);
+    return true;
 }
 
 SHARED_EXPORT
@@ -454,16 +2304,46 @@ void vbar_free(void *devctx, void *vbar) {
     set_devctx((AimdoContext *)devctx);
 
     log(DEBUG, "%s: vbar=%p\n", __func__, vbar);
+    vbars_lock_exclusive();
     vbars_dirty = true;
+    if (mv->locked_end) {
+        log(WARNING, "%s: VBAR %p freed while graph locked\n", __func__, vbar);
+        graph_locks_drop_vbar(mv);
+    }
 
     CHECK_CU(cuCtxSynchronize());
 
     for (uint64_t page_nr = 0; page_nr < mv->nr_pages; page_nr++) {
-        mod1(mv, page_nr, true, true);
+        ResidentPage *rp = &mv->residency_map[page_nr];
+
+        page_unmap_host(mv, page_nr);
+        if (!page_orphan(mv, page_nr)) {
+            mod1(mv, page_nr, true, true, VBAR_EVICT_NONE);
+        }
+        if (rp->fence) {
+            CHECK_CU(cuEventDestroy(rp->fence));
+        }
+        if (rp->populate_fence) {
+            CHECK_CU(cuEventDestroy(rp->populate_fence));
+        }
     }
+    vbar_sources_free(mv);
+    vbar_reserved -= (uint64_t)mv->reserved_pages * mv->page_size;
+    vbar_heap_pages -= mv->nr_pages;
     remove_vbar(mv);
-    CHECK_CU(cuMemAddressFree(mv->vbar, (size_t)mv->nr_pages * VBAR_PAGE_SIZE));
+    vbars_unlock_exclusive();
+
+    for (size_t i = 0, first = 0; i < mv->nr_segments; first = mv->segment_ends[i++]) {
+        CHECK_CU(cuMemAddressFree(mv->vbar + first * mv->page_size,
+                                  (mv->segment_ends[i] - first) * mv->page_size));
+    }
     CHECK_CU(cuCtxSynchronize());
+    mutex_destroy(mv->lock);
+    condvar_destroy(mv->populate_cond);
+    free(mv->segment_ends);
+    free(mv->resident);
+    free(mv->prefetched);
+    free(mv->residency_map);
     free(mv);
 }
 
@@ -471,9 +2351,21 @@ SHARED_EXPORT
 size_t vbar_loaded_size(void *devctx, void *vbar) {
     ModelVBAR *mv = (ModelVBAR *)vbar;
 
+    size_t loaded;
+
     set_devctx((AimdoContext *)devctx);
 
-    return mv->resident_count * VBAR_PAGE_SIZE;
+    vbars_lock_shared();
+    loaded = mv->resident_count * mv->page_size;
+    vbars_unlock_shared();
+    return loaded;
+}
+
+SHARED_EXPORT
+size_t vbar_get_page_size(void *devctx, void *vbar) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    set_devctx((AimdoContext *)devctx);
+    return mv->page_size;
 }
 
 SHARED_EXPORT
@@ -486,8 +2378,13 @@ size_t vbar_get_nr_pages(void *devctx, void *vbar) {
 SHARED_EXPORT
 size_t vbar_get_watermark(void *devctx, void *vbar) {
     ModelVBAR *mv = (ModelVBAR *)vbar;
+    size_t watermark;
+
     set_devctx((AimdoContext *)devctx);
-    return mv->watermark;
+    vbars_lock_shared();
+    watermark = mv->watermark;
+    vbars_unlock_shared();
+    return watermark;
 }
 
 SHARED_EXPORT
@@ -496,37 +2393,174 @@ void vbar_get_residency(void *devctx, void *vbar, uint8_t *out, size_t max_pages
     size_t n = mv->nr_pages < max_pages ? mv->nr_pages : max_pages;
 
     set_devctx((AimdoContext *)devctx);
+    vbars_lock_shared();
+    mutex_lock(mv->lock);
     for (size_t i = 0; i < n; i++) {
         ResidentPage *rp = &mv->residency_map[i];
-        /* bit 0: resident, bit 1: pinned */
-        out[i] = (rp->handle ? 1 : 0) | (rp->pin_count ? 2 : 0);
+        /* bit 0: resident, bit 1: pinned, bit 2: prefetched and not yet used,
+         * bit 3: graph locked, bit 4: backed by host memory
+         */
+        out[i] = (rp->handle ? 1 : 0) | (rp->pin_count ? 2 : 0) | (rp->prefetched ? 4 : 0) |
+                 (rp->graph_locks ? 8 : 0) | (rp->host_handle ? 16 : 0);
     }
+    mutex_unlock(mv->lock);
+    vbars_unlock_shared();
 }
 
 SHARED_EXPORT
 uint64_t vbar_free_memory(void *devctx, void *vbar, uint64_t size) {
     ModelVBAR *mv = (ModelVBAR *)vbar;
-    size_t pages_to_free = VBAR_GET_PAGE_NR_UP(size);
+    size_t pages_to_free = VBAR_GET_PAGE_NR_UP(mv, size);
     size_t pages_freed = 0;
 
     set_devctx((AimdoContext *)devctx);
 
     log(DEBUG, "%s (start): size=%lldk\n", __func__, (ull)size);
+    vbars_lock_exclusive();
     vbars_dirty = true;
 
-    CHECK_CU(cuCtxSynchronize());
+    while (pages_to_free && mv->watermark > vbar_watermark_floor(mv)) {
+        size_t page_nr = bitmap_find_last(mv->resident, vbar_watermark_floor(mv), mv->watermark);
+        size_t freed;
 
-    for (;pages_to_free && mv->watermark > mv->watermark_limit; mv->watermark--) {
+        if (page_nr == SIZE_MAX) {
+            mv->watermark = vbar_watermark_floor(mv);
+            break;
+        }
+        mv->watermark = page_nr;
         /* In theory we should never have pins here, but
          * respect pins if it really comes up.
          */
-        if (mod1(mv, mv->watermark - 1, true, false)) {
-            pages_to_free--;
-            pages_freed++;
+        freed = mod1(mv, page_nr, true, false, VBAR_EVICT_WATERMARK);
+        pages_to_free -= MIN(freed, pages_to_free);
+        pages_freed += freed;
+    }
+
+    /* The caller wants this memory gone, not recycled */
+    vrampool_trim(SIZE_MAX, 0);
+    vbars_unlock_exclusive();
+
+    return (uint64_t)pages_freed * mv->page_size;
+}
+
+/* Copy out the watermarks and which pages are resident. resident takes
+ * BITMAP_WORDS(nr_pages) words; false if words is short.
+ */
+SHARED_EXPORT
+bool vbar_plan_export(void *devctx, void *vbar, VbarPlan *plan, uint64_t *resident, size_t words) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+
+    set_devctx((AimdoContext *)devctx);
+    if (words < BITMAP_WORDS(mv->nr_pages)) {
+        log(ERROR, "%s: %zu words for %zu pages\n", __func__, words, mv->nr_pages);
+        return false;
+    }
+
+    vbars_lock_shared();
+    plan->page_size = mv->page_size;
+    plan->nr_pages = mv->nr_pages;
+    plan->watermark = mv->watermark;
+    plan->watermark_limit = mv->watermark_limit;
+    memcpy(resident, mv->resident, BITMAP_WORDS(mv->nr_pages) * sizeof(*resident));
+    vbars_unlock_shared();
+
+    log(DEBUG, "%s: vbar=%p watermark=%zu limit=%zu\n", __func__, vbar, mv->watermark,
+        mv->watermark_limit);
+    return true;
+}
+
+/* Give the planned pages from page_nr up to page_end memory as prefetched on
+ * stream, but only while the budget has room. Returns where it stopped:
+ * page_end, or the first page that did not fit.
+ */
+static size_t plan_fault(ModelVBAR *mv, const uint64_t *plan, size_t page_nr, size_t page_end,
+                         cudaStream_t stream) {
+    while (page_nr < page_end) {
+        size_t range_end = bitmap_find_next_clear(plan, page_nr, page_end);
+        ResidentPage *rp = &mv->residency_map[page_nr];
+        size_t run;
+
+        if (page_nr == range_end || rp->handle || rp->host_handle) {
+            page_nr = page_nr == range_end ? bitmap_find_next(plan, page_nr, page_end) : page_nr + 1;
+            continue;
+        }
+        vbar_page_prefetch(mv, page_nr, (CUstream)stream);
+        if (page_adopt(mv, page_nr)) {
+            page_nr++;
+            continue;
+        }
+        if ((run = fault_run(mv, page_nr, range_end))) {
+            for (size_t i = 0; i < run; i++) {
+                vbar_page_prefetch(mv, page_nr + i, (CUstream)stream);
+                vbar_heap_update(mv, page_nr + i);
+            }
+            page_nr += run;
+            continue;
         }
+        if ((!vrampool_available(mv->page_size) && budget_deficit(mv->page_size) > 0) ||
+            three_stooges(mv->vbar + page_nr * mv->page_size, mv->page_size, mv->device,
+                          &rp->handle) != CUDA_SUCCESS) {
+            rp->prefetched = false;
+            return page_nr;
+        }
+        vbar_page_touch(mv, rp, true);
+        rp->serial = ++vbar_serial;
+        vbar_page_resident(mv, page_nr);
+        page_nr++;
     }
+    return page_end;
+}
 
-    CHECK_CU(cuCtxSynchronize());
+/* Warm start a VBAR from a vbar_plan_export() of an earlier run with the same
+ * layout: restore its watermarks and fault the pages that were resident, in
+ * one pass and as far as the budget goes without evicting anything. Faulted
+ * pages count as prefetched on stream, where pages with an attached source are
+ * populated. *prefaulted is the memory now resident for the plan.
+ */
+SHARED_EXPORT
+bool vbar_plan_import(void *devctx, void *vbar, const VbarPlan *plan, const uint64_t *resident,
+                      cudaStream_t stream, uint64_t *prefaulted) {
+    ModelVBAR *mv = (ModelVBAR *)vbar;
+    VbarPopulate job = { 0 };
+    size_t watermark;
+    size_t stop;
+    bool ret;
 
-    return (uint64_t)pages_freed * VBAR_PAGE_SIZE;
+    set_devctx((AimdoContext *)devctx);
+    *prefaulted = 0;
+
+    if (plan->page_size != mv->page_size || plan->nr_pages != mv->nr_pages) {
+        log(WARNING, "%s: plan for %llu pages of %lluk does not fit VBAR of %zu pages of %zuk\n",
+            __func__, (ull)plan->nr_pages, (ull)(plan->page_size / K), mv->nr_pages,
+            mv->page_size / K);
+        return false;
+    }
+
+    vbars_lock_exclusive();
+    vbars_dirty = true;
+
+    watermark = MAX((size_t)MIN(plan->watermark, (uint64_t)mv->nr_pages), mv->locked_end);
+    for (size_t page_nr = watermark; page_nr < mv->watermark; page_nr++) {
+        mod1(mv, page_nr, true, false, VBAR_EVICT_WATERMARK);
+    }
+    mv->watermark = watermark;
+    mv->watermark_limit = (size_t)MIN(plan->watermark_limit, (uint64_t)mv->nr_pages);
+
+    vbars_free_protected(budget_deficit(0), NULL, 0, VBAR_EVICT_ALLOCATOR);
+
+    stop = plan_fault(mv, resident, 0, mv->watermark, stream);
+    for (size_t page_nr = 0; page_nr < stop; page_nr++) {
+        if (mv->residency_map[page_nr].handle && bitmap_test(resident, page_nr)) {
+            *prefaulted += mv->page_size;
+        }
+    }
+    ret = populate_claim(mv, 0, (uint64_t)stop * mv->page_size, &job);
+    vbars_unlock_exclusive();
+
+    populate_run(mv, 0, (uint64_t)stop * mv->page_size, &job, stream, &ret);
+
+    log(DEBUG, "%s: vbar=%p watermark=%zu limit=%zu prefaulted=%zu MB%s\n", __func__, vbar,
+        mv->watermark, mv->watermark_limit, (size_t)(*prefaulted / M),
+        stop < mv->watermark ? " (budget exhausted)" : "");
+    return ret;
 }
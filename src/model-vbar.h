@@ -0,0 +1,449 @@
+#pragma once
+
+#include "plat.h"
+#include "bitmap.h"
+#include "thread-plat.h"
+
+/* Page size is per VBAR. Anything from the driver allocation granularity up
+ * to VBAR_PAGE_SIZE_MAX in granularity multiples, trading eviction granularity
+ * for cuMemCreate/cuMemMap call count.
+ */
+#define VBAR_PAGE_SIZE_DEFAULT (32 << 20)
+#define VBAR_PAGE_SIZE_MAX (128 << 20)
+
+/* Contiguous absent pages of a fault are allocated and mapped as one run of up
+ * to this much, while the budget has room. A run is evicted as a whole, as
+ * part of a mapping cannot be unmapped.
+ */
+#define VBAR_RUN_SIZE_MAX (256 << 20)
+
+/* Reload bandwidth assumed for pages nobody set one for, in bytes/sec */
+#define VBAR_RELOAD_BW_DEFAULT (1ULL << 30)
+
+#define VBAR_GET_PAGE_NR(mv, x) ((x) / (mv)->page_size)
+#define VBAR_GET_PAGE_NR_UP(mv, x) VBAR_GET_PAGE_NR(mv, (x) + (mv)->page_size - 1)
+
+#define VBAR_FAULT_SUCCESS           0
+#define VBAR_FAULT_OOM               1
+#define VBAR_FAULT_ERROR             2
+
+/* Where a range of a VBAR gets its contents from, so that faults can populate
+ * pages without a round trip through the application. key, if not 0, names
+ * the contents so that pages can outlive the VBAR in the orphan cache.
+ */
+enum VbarSourceKind {
+    VBAR_SOURCE_FILE = 0,
+    VBAR_SOURCE_HOST,
+    VBAR_SOURCE_NONE, /* Key only, the application populates */
+};
+
+typedef struct VbarSource {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t key;
+    int kind;
+    union {
+        struct {
+            uint64_t handle;
+            uint64_t offset;
+        } file;
+        const uint8_t *host;
+    };
+} VbarSource;
+
+struct VbarShare;
+struct VbarPopulate;
+
+typedef struct ResidentPage {
+    CUmemGenericAllocationHandle handle; /* Shared by every page of a run */
+    struct VbarShare *share; /* Set while other VBARs map the same handle */
+    uint32_t run_pages; /* 0 for a page with its own allocation */
+    uint32_t run_index;
+    uint32_t pin_count;
+    size_t serial;
+    size_t populated_serial; /* == serial once populated from the VBAR sources */
+    CUevent fence; /* Recorded on the caller's stream when the last pin drops */
+
+    /* Faulted by vbar_prefetch() and not yet used by a real fault. The caller
+     * populates it on prefetch_stream, so eviction waits on that instead.
+     */
+    bool prefetched;
+    CUstream prefetch_stream;
+
+    /* The populate that claimed the page and is queueing its copies outside
+     * vbars_lock. Counts as a pin until it is done. Set and cleared under
+     * mv->lock.
+     */
+    struct VbarPopulate *populating;
+
+    /* Recorded on populate_stream after the page's populate copies. While
+     * populate_pending, a fault of the page from another stream waits on it
+     * and eviction synchronizes with it. Under mv->lock, kept like fence.
+     */
+    CUevent populate_fence;
+    CUstream populate_stream;
+    bool populate_pending;
+
+    /* Modified on the GPU since it was populated (vbar_mark_dirty()). Eviction
+     * copies it out to the write-back regions first, and from then on it is
+     * written_back and populates from them rather than from its sources.
+     */
+    bool dirty;
+    bool written_back;
+
+    /* Private copy faulted by vbar_fault_write(). The application writes to
+     * it, so it no longer holds what its sources key names. Cleared on eviction.
+     */
+    bool overlay;
+
+    /* Pinned host memory mapped at the page's address while it has no VRAM,
+     * see vbar_fault_host(). Never set together with handle.
+     */
+    CUmemGenericAllocationHandle host_handle;
+
+    /* Held by vbar_graph_lock() tokens. Counts as a pin that vbar_unpin()
+     * does not drop, and the page stays below the watermark.
+     */
+    uint32_t graph_locks;
+
+    /* How fast the page's contents come back once evicted, in bytes/sec. 0
+     * for the VBAR's.
+     */
+    uint64_t reload_bw;
+
+    /* Access tracking for the non-priority eviction policies */
+    uint64_t last_access;
+    uint64_t credit;
+    uint32_t hits;
+    size_t heap_slot; /* Index + 1 in the victim heap while resident */
+} ResidentPage;
+
+typedef struct ModelVBAR {
+    CUdeviceptr vbar;
+    size_t page_size;
+    size_t nr_pages;
+    /* VA reservations back to back from vbar, one more per vbar_grow(). Each
+     * ends at the page in segment_ends. A mapping cannot span two of them.
+     */
+    size_t *segment_ends;
+    size_t nr_segments;
+    size_t watermark;
+    size_t watermark_limit;
+    /* Guaranteed residency. Eviction for anything but the VBAR itself stops
+     * once it is down to this many resident pages. See vbar_set_reservation().
+     */
+    size_t reserved_pages;
+    /* End of the highest graph locked page. The watermark stays above it. */
+    size_t locked_end;
+    /* Reload bandwidth of pages without their own, bytes/sec. 0 for the default. */
+    uint64_t reload_bw;
+    uint32_t weight; /* Share of VRAM under the fair-share policy */
+    /* Pages currently backed by host memory, and how many may be */
+    size_t host_pages;
+    size_t host_pages_limit;
+
+    int device;
+
+    void *higher;
+    void *lower;
+
+    size_t resident_count;
+    uint64_t *resident; /* Bit per page with memory behind it */
+    /* Bit per page that may be prefetched, see vbar_page_prefetch() */
+    uint64_t *prefetched;
+    ResidentPage *residency_map; /* nr_pages of them, reallocated by vbar_grow() */
+
+    /* Sorted by offset, non-overlapping */
+    VbarSource *sources;
+    size_t nr_sources;
+    size_t sources_cap;
+    /* Host memory dirty pages are saved to on eviction. Same rules as sources. */
+    VbarSource *writebacks;
+    size_t nr_writebacks;
+    size_t writebacks_cap;
+    /* Bumped under lock whenever a populate finishes, with populate_cond
+     * broadcast, for faults waiting on another thread's populate.
+     */
+    uint64_t populate_gen;
+    CondVar populate_cond;
+
+    /* Guards pins, fences and access stats on the shared hit path. Anything
+     * that changes residency holds vbars_lock exclusively instead.
+     */
+    Mutex lock;
+} ModelVBAR;
+
+/* model-vbar-policy.c. Every resident page is in the device's victim heap. */
+bool vbar_heap_reserve(size_t nr_pages);
+void vbar_heap_insert(ModelVBAR *mv, size_t page_nr);
+void vbar_heap_remove(ModelVBAR *mv, size_t page_nr);
+void vbar_heap_update(ModelVBAR *mv, size_t page_nr);
+
+static inline void vbar_page_resident(ModelVBAR *mv, size_t page_nr) {
+    bitmap_set(mv->resident, page_nr);
+    mv->resident_count++;
+    vbar_heap_insert(mv, page_nr);
+}
+
+static inline void vbar_page_absent(ModelVBAR *mv, size_t page_nr) {
+    bitmap_clear(mv->resident, page_nr);
+    mv->resident_count--;
+    vbar_heap_remove(mv, page_nr);
+}
+
+/* Mark the page as prefetched on stream. Under the exclusive lock. Only set
+ * here, and left behind when rp->prefetched is cleared, which can happen on
+ * the shared hit path. vbar_prefetched_victim() drops stale bits it visits.
+ */
+static inline void vbar_page_prefetch(ModelVBAR *mv, size_t page_nr, CUstream stream) {
+    mv->residency_map[page_nr].prefetched = true;
+    mv->residency_map[page_nr].prefetch_stream = stream;
+    bitmap_set(mv->prefetched, page_nr);
+}
+
+/* One physical page mapped into several VBARs by vbar_share(). The VRAM counts
+ * once. Evicting it for memory unmaps it from every holder, while a holder
+ * dropping it for its own reasons only unmaps its own mapping. The last holder
+ * left owns the handle outright.
+ */
+typedef struct VbarShareHolder {
+    ModelVBAR *mv;
+    size_t page_nr;
+} VbarShareHolder;
+
+typedef struct VbarShare {
+    CUmemGenericAllocationHandle handle;
+    size_t nr_holders;
+    size_t holders_cap;
+    VbarShareHolder *holders; /* holders[0] is accounted for its VRAM */
+} VbarShare;
+
+static inline size_t vbar_run_first(ModelVBAR *mv, size_t page_nr) {
+    return page_nr - mv->residency_map[page_nr].run_index;
+}
+
+static inline size_t vbar_run_pages(ModelVBAR *mv, size_t page_nr) {
+    return MAX(mv->residency_map[page_nr].run_pages, 1);
+}
+
+/* End of the VA segment page_nr is in */
+static inline size_t vbar_segment_end(ModelVBAR *mv, size_t page_nr) {
+    size_t i = 0;
+
+    while (mv->segment_ends[i] <= page_nr) {
+        i++;
+    }
+    return mv->segment_ends[i];
+}
+
+static inline size_t vbar_watermark_floor(ModelVBAR *mv) {
+    return MAX(mv->watermark_limit, mv->locked_end);
+}
+
+static inline uint64_t vbar_page_reload_bw(ModelVBAR *mv, size_t page_nr) {
+    uint64_t bw = mv->residency_map[page_nr].reload_bw;
+
+    return bw ? bw : mv->reload_bw ? mv->reload_bw : VBAR_RELOAD_BW_DEFAULT;
+}
+
+static inline bool vbar_run_pinned(ModelVBAR *mv, size_t page_nr) {
+    size_t first = vbar_run_first(mv, page_nr);
+    VbarShare *share = mv->residency_map[page_nr].share;
+
+    if (share) {
+        for (size_t i = 0; i < share->nr_holders; i++) {
+            ResidentPage *rp = &share->holders[i].mv->residency_map[share->holders[i].page_nr];
+
+            if (rp->pin_count || rp->graph_locks || rp->populating) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    for (size_t i = first; i < first + vbar_run_pages(mv, page_nr); i++) {
+        ResidentPage *rp = &mv->residency_map[i];
+
+        if (rp->pin_count || rp->graph_locks || rp->populating) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Whether mv has residency above its reservation for pages to be taken for
+ * someone else
+ */
+static inline bool vbar_over_reservation(ModelVBAR *mv, size_t nr_pages) {
+    return mv->resident_count >= mv->reserved_pages + nr_pages;
+}
+
+/* Whether page_nr of mv is also mapped into the protected pages of another
+ * VBAR, which evicting it would unmap without touching that VBAR's watermark
+ */
+static inline bool vbar_share_protected(ModelVBAR *mv, size_t page_nr,
+                                        ModelVBAR *protect, size_t protect_end) {
+    VbarShare *share = mv->residency_map[page_nr].share;
+
+    if (!share || !protect || mv == protect) {
+        return false;
+    }
+    for (size_t i = 0; i < share->nr_holders; i++) {
+        if (share->holders[i].mv == protect && share->holders[i].page_nr < protect_end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Whether evicting page_nr, and with it the rest of its run, is allowed when
+ * faulting protect (NULL for pressure from outside the VBARs). A protected page
+ * itself is for the policy to pass over, or to take when it truncates the
+ * faulting VBAR. A run must not reach from outside into the protected pages,
+ * and neither may a shared page.
+ */
+static inline bool vbar_page_evictable(ModelVBAR *mv, size_t page_nr,
+                                       ModelVBAR *protect, size_t protect_end) {
+    if (mv == protect) {
+        return (page_nr < protect_end || vbar_run_first(mv, page_nr) >= protect_end) &&
+               !vbar_run_pinned(mv, page_nr);
+    }
+    return vbar_over_reservation(mv, vbar_run_pages(mv, page_nr)) && !vbar_run_pinned(mv, page_nr) &&
+           !vbar_share_protected(mv, page_nr, protect, protect_end);
+}
+
+/* Eviction policies, selected per device context.
+ *
+ * PRIORITY is the classic behaviour: lowest priority VBAR first, highest page
+ * first, truncating the watermark as it goes. The next VBAR up goes first
+ * instead if its pages reload much faster (see vbar_set_reload_bw()).
+ *
+ * RECENCY and COST evict individual pages from anywhere and leave watermarks
+ * alone. RECENCY picks the least recently faulted page. COST is GreedyDual
+ * style: each hit credits a page with its reload cost, and the page with the
+ * least credit goes first, which ages out pages that stopped being used. Both
+ * take their victim from a per-device min-heap of the resident pages.
+ *
+ * FAIRSHARE is for concurrent jobs sharing a GPU, where LIFO priority has them
+ * evict each other in turn. Each VBAR with residency is entitled to a share of
+ * the resident total in proportion to its weight (see vbar_set_weight()), and
+ * the VBAR furthest above its share is truncated from the top like PRIORITY.
+ */
+enum VbarPolicyId {
+    VBAR_POLICY_PRIORITY = 0,
+    VBAR_POLICY_RECENCY,
+    VBAR_POLICY_COST,
+    VBAR_POLICY_FAIRSHARE,
+    VBAR_POLICY_COUNT,
+};
+
+typedef struct VbarPolicy {
+    const char *name;
+    bool truncates_watermark;
+    /* next_victim() already puts unused prefetched pages first */
+    bool ranks_prefetched;
+    /* Find the next page to try to evict. protect/protect_end name pages of a
+     * faulting VBAR that must be left alone. Returns false when there is
+     * nothing left to try.
+     */
+    bool (*next_victim)(ModelVBAR *protect, size_t protect_end,
+                        ModelVBAR **victim, size_t *page_nr);
+} VbarPolicy;
+
+/* Keyed by the page's last_access or credit, whichever the policy goes by, as
+ * of when the entry was last sifted. Hits only ever raise a page's key, so an
+ * entry is never above its page and catches up when it reaches the top.
+ */
+typedef struct VbarHeapEntry {
+    ModelVBAR *mv;
+    size_t page_nr;
+    uint64_t key;
+} VbarHeapEntry;
+
+/* A VBAR's steady state, saved by vbar_plan_export() for vbar_plan_import()
+ * to warm start from. Layout shared with comfy_aimdo/model_vbar.py, and
+ * followed by BITMAP_WORDS(nr_pages) words of resident page bitmap.
+ */
+typedef struct VbarPlan {
+    uint64_t page_size;
+    uint64_t nr_pages;
+    uint64_t watermark;
+    uint64_t watermark_limit;
+} VbarPlan;
+
+/* Why a run of pages was evicted, as reported by vbar_events_drain() */
+enum VbarEvictReason {
+    VBAR_EVICT_NONE = -1, /* Not reported, e.g. the VBAR itself is going away */
+    VBAR_EVICT_FAULT = 0, /* Making room for a fault of another VBAR */
+    VBAR_EVICT_ALLOCATOR, /* Allocations outside the VBARs */
+    VBAR_EVICT_WATERMARK, /* The application lowered the watermark or freed memory */
+    VBAR_EVICT_RECLAIM, /* The background reclaimer keeping the VRAM reserve */
+};
+
+/* Layout shared with comfy_aimdo/model_vbar.py */
+typedef struct VbarEvictEvent {
+    uint64_t vbar; /* ModelVBAR * */
+    uint64_t offset;
+    uint64_t size;
+    uint64_t serial; /* Of the first page, as last seen in a signature */
+    uint32_t reason;
+    uint32_t pad;
+} VbarEvictEvent;
+
+/* One copy of a populate. File reads take long enough that they must not
+ * happen under vbars_lock, so a populate gathers its copies under the lock
+ * and queues them after dropping it.
+ */
+typedef struct VbarCopy {
+    CUdeviceptr dst;
+    uint64_t size;
+    int kind; /* VBAR_SOURCE_FILE or VBAR_SOURCE_HOST */
+    union {
+        struct {
+            uint64_t handle;
+            uint64_t offset;
+        } file;
+        const uint8_t *host;
+    };
+} VbarCopy;
+
+typedef struct VbarPopulate {
+    VbarCopy *copies;
+    size_t nr_copies;
+    size_t copies_cap;
+} VbarPopulate;
+
+/* model-vbar-source.c */
+bool vbar_populate_page(ModelVBAR *mv, size_t page_nr, VbarPopulate *job);
+bool vbar_populate_issue(ModelVBAR *mv, VbarPopulate *job, cudaStream_t stream);
+void vbar_populate_release(VbarPopulate *job);
+void vbar_sources_free(ModelVBAR *mv);
+bool vbar_sources_copy(ModelVBAR *dst, ModelVBAR *src);
+uint64_t vbar_page_key(ModelVBAR *mv, size_t page_nr);
+bool vbar_writeback_page(ModelVBAR *mv, size_t page_nr, cudaStream_t stream);
+
+/* hostbuf-file-reader.c */
+bool hostbuf_file_reader_read(int device, uint64_t file_handle, uint64_t file_offset,
+                              uint64_t size, cudaStream_t stream,
+                              uint64_t device_ptr, bool mark_cold);
+
+/* model-vbar-events.c */
+void vbar_event_record(ModelVBAR *mv, size_t first, size_t nr_pages, int reason);
+
+/* model-vbar-policy.c */
+extern const VbarPolicy *const vbar_policies[VBAR_POLICY_COUNT];
+void vbar_page_touch(ModelVBAR *mv, ResidentPage *rp, bool fresh);
+bool vbar_prefetched_victim(ModelVBAR *protect, size_t protect_end,
+                            ModelVBAR **victim, size_t *page_nr);
+
+static inline const VbarPolicy *vbar_policy(void) {
+    return vbar_policies[vbar_policy_id];
+}
+
+/* Prefetched pages nobody has used yet go before anything the policy picks */
+static inline bool vbar_next_victim(ModelVBAR *protect, size_t protect_end,
+                                    ModelVBAR **victim, size_t *page_nr) {
+    return (!vbar_policy()->ranks_prefetched &&
+            vbar_prefetched_victim(protect, protect_end, victim, page_nr)) ||
+           vbar_policy()->next_victim(protect, protect_end, victim, page_nr);
+}
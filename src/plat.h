@@ -30,6 +30,10 @@ typedef struct CUstream_st *cudaStream_t;
 #include <stdlib.h>
 #include <assert.h>
 
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
 /* control.c */
 bool cuda_budget_deficit(const char **prevailing_deficit_method);
 
@@ -73,7 +77,10 @@ void *aimdo_find_loaded_module(const char *const *libraries, size_t library_coun
 #define cuGetErrorString            g_cuda.p_cuGetErrorString
 #define cuCtxGetDevice              g_cuda.p_cuCtxGetDevice
 #define cuCtxSynchronize            g_cuda.p_cuCtxSynchronize
+#define cuCtxSetCurrent             g_cuda.p_cuCtxSetCurrent
 #define cuDeviceGet                 g_cuda.p_cuDeviceGet
+#define cuDevicePrimaryCtxRetain    g_cuda.p_cuDevicePrimaryCtxRetain
+#define cuDevicePrimaryCtxRelease   g_cuda.p_cuDevicePrimaryCtxRelease
 #define cuDeviceGetAttribute        g_cuda.p_cuDeviceGetAttribute
 #define cuDeviceTotalMem            g_cuda.p_cuDeviceTotalMem
 #define cuDeviceGetName             g_cuda.p_cuDeviceGetName
@@ -87,13 +94,18 @@ void *aimdo_find_loaded_module(const char *const *libraries, size_t library_coun
 #define cuMemCreate                 g_cuda.p_cuMemCreate
 #define cuMemMap                    g_cuda.p_cuMemMap
 #define cuMemSetAccess              g_cuda.p_cuMemSetAccess
+#define cuMemGetAllocationGranularity g_cuda.p_cuMemGetAllocationGranularity
 #define cuMemUnmap                  g_cuda.p_cuMemUnmap
 #define cuMemRelease                g_cuda.p_cuMemRelease
 #define cuMemcpyHtoDAsync           g_cuda.p_cuMemcpyHtoDAsync
+#define cuMemcpyDtoHAsync           g_cuda.p_cuMemcpyDtoHAsync
+#define cuMemcpyDtoDAsync           g_cuda.p_cuMemcpyDtoDAsync
 #define cuEventCreate               g_cuda.p_cuEventCreate
 #define cuEventDestroy              g_cuda.p_cuEventDestroy
 #define cuEventRecord               g_cuda.p_cuEventRecord
 #define cuEventSynchronize          g_cuda.p_cuEventSynchronize
+#define cuEventQuery                g_cuda.p_cuEventQuery
+#define cuStreamWaitEvent           g_cuda.p_cuStreamWaitEvent
 #define cuDeviceGetLuid             g_cuda.p_cuDeviceGetLuid
 
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
@@ -147,6 +159,42 @@ void log_reset_shots();
 #define VRAM_HEADROOM (256 * 1024 * 1024)
 extern int64_t simple_vram_headroom;
 
+/* Default high-water mark for recycled physical pages, per device */
+#define VRAM_POOL_LIMIT (256 * 1024 * 1024)
+
+/* Returns the new value */
+static inline uint64_t atomic_add_u64(uint64_t *p, int64_t delta) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    return (uint64_t)_InterlockedExchangeAdd64((volatile __int64 *)p, delta) + (uint64_t)delta;
+#else
+    return __atomic_add_fetch(p, (uint64_t)delta, __ATOMIC_RELAXED);
+#endif
+}
+
+/* Acquire/release pair for single producer, single consumer handoff */
+static inline uint64_t atomic_load_acquire_u64(uint64_t *p) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    return (uint64_t)_InterlockedCompareExchange64((volatile __int64 *)p, 0, 0);
+#else
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static inline void atomic_store_release_u64(uint64_t *p, uint64_t v) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    _InterlockedExchange64((volatile __int64 *)p, (__int64)v);
+#else
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+#endif
+}
+
+/* The allocator hooks account under their own lock and the VBAR code under
+ * the VBAR lock, so the shared total is only ever adjusted atomically.
+ */
+static inline void vram_usage_add(int64_t delta) {
+    atomic_add_u64(&total_vram_usage, delta);
+}
+
 static inline ssize_t budget_deficit(size_t size) {
     ssize_t deficit_simple, deficit_delta;
     ssize_t deficit;
@@ -179,50 +227,86 @@ static inline int check_cu_impl(CUresult res, const char *label) {
 }
 #define CHECK_CU(x) check_cu_impl((x), #x)
 
-static inline CUresult three_stooges(CUdeviceptr vaddr, size_t size, int device,
-                                     CUmemGenericAllocationHandle *handle) {
-    CUmemGenericAllocationHandle h = 0;
+/* vram-pool.c */
+bool vrampool_take(size_t size, CUmemGenericAllocationHandle *handle);
+void vrampool_put(CUmemGenericAllocationHandle handle, size_t size);
+size_t vrampool_available(size_t size);
+size_t vrampool_trim(size_t size, size_t keep_size);
+void vrampool_orphan(CUmemGenericAllocationHandle handle, size_t size, uint64_t key, size_t serial);
+bool vrampool_adopt(uint64_t key, size_t size, CUmemGenericAllocationHandle *handle, size_t *serial);
+
+/* Map an existing physical allocation. Ownership of h stays with the caller. */
+static inline CUresult two_stooges(CUdeviceptr vaddr, size_t size, int device,
+                                   CUmemGenericAllocationHandle h) {
     CUresult err;
 
-    CUmemAllocationProp prop = {
-        .type = CU_MEM_ALLOCATION_TYPE_PINNED,
+    CUmemAccessDesc accessDesc = {
         .location.type = CU_MEM_LOCATION_TYPE_DEVICE,
         .location.id = device,
+        .flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE,
     };
 
-    CUmemAccessDesc accessDesc = {
+    if (!CHECK_CU(err = cuMemMap(vaddr, size, 0, h, 0))) {
+        return err;
+    }
+    if (!CHECK_CU(err = cuMemSetAccess(vaddr, size, &accessDesc, 1))) {
+        CHECK_CU(cuMemUnmap(vaddr, size));
+        unmap_workaround(vaddr, size);
+        return err;
+    }
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult three_stooges(CUdeviceptr vaddr, size_t size, int device,
+                                     CUmemGenericAllocationHandle *handle) {
+    CUmemGenericAllocationHandle h = 0;
+    CUresult err = CUDA_SUCCESS;
+    bool pooled = vrampool_take(size, &h);
+
+    CUmemAllocationProp prop = {
+        .type = CU_MEM_ALLOCATION_TYPE_PINNED,
         .location.type = CU_MEM_LOCATION_TYPE_DEVICE,
         .location.id = device,
-        .flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE,
     };
 
-    if (!CHECK_CU(err = cuMemCreate(&h, size, &prop, 0))) {
+    if (!pooled && !CHECK_CU(err = cuMemCreate(&h, size, &prop, 0))) {
         goto fail;
     }
-    if (!CHECK_CU(err = cuMemMap(vaddr, size, 0, h, 0))) {
+    if ((err = two_stooges(vaddr, size, device, h)) != CUDA_SUCCESS) {
         goto fail_mmap;
     }
-    if (!CHECK_CU(err = cuMemSetAccess(vaddr, size, &accessDesc, 1))) {
-        goto fail_access;
+    if (!pooled) {
+        vram_usage_add((int64_t)size);
     }
-    total_vram_usage += size;
 
     *handle = h;
     return CUDA_SUCCESS;
 
-fail_access:
-    CHECK_CU(cuMemUnmap(vaddr, size));
-    unmap_workaround(vaddr, size);
 fail_mmap:
-    CHECK_CU(cuMemRelease(h));
+    if (pooled) {
+        vrampool_put(h, size);
+    } else {
+        CHECK_CU(cuMemRelease(h));
+    }
 fail:
     return err;
 }
 
+/* vram-reclaim.c */
+void vram_reclaim_kick(void);
+void vram_reclaim_stop(void);
+
 /* model_vbar.c */
 size_t vbars_free(ssize_t size);
+size_t vbars_free_deficit(size_t size);
+size_t vbars_reclaim(size_t reserve, size_t batch);
+bool vbars_page_size_used(size_t size);
+void vbars_lock_exclusive(void);
+void vbars_unlock_exclusive(void);
 SHARED_EXPORT
 uint64_t vbars_analyze(void *devctx, bool only_dirty);
+SHARED_EXPORT
+void vbar_free(void *devctx, void *vbar);
 
 /* pyt-cu-alloc.c */
 int aimdo_cuda_malloc(CUdeviceptr *dptr, size_t size,
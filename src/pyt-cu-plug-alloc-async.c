@@ -110,7 +110,7 @@ static inline void account_alloc(CUdeviceptr ptr, size_t size) {
     SizeEntry *entry;
 
     st_lock();
-    total_vram_usage += accounted_alloc_size(size);
+    vram_usage_add((int64_t)accounted_alloc_size(size));
 
     entry = (SizeEntry *)malloc(sizeof(*entry));
     if (entry) {
@@ -136,7 +136,7 @@ static inline void account_free(CUdeviceptr ptr, CUstream hStream) {
             *prev = entry->next;
 
             log(VVERBOSE, "Freed: ptr=0x%llx, size=%zuk, stream=%p\n", ptr, entry->size / K, hStream);
-            total_vram_usage -= accounted_alloc_size(entry->size);
+            vram_usage_add(-(int64_t)accounted_alloc_size(entry->size));
 
             st_unlock();
             free(entry);
@@ -163,7 +163,7 @@ int aimdo_cuda_malloc(CUdeviceptr *devPtr, size_t size,
         return true_cuMemAlloc_v2(devPtr, size);
     }
 
-    vbars_free(budget_deficit(size + CUDA_MALLOC_HEADROOM));
+    vbars_free_deficit(size + CUDA_MALLOC_HEADROOM);
 
     if (CHECK_CU(true_cuMemAlloc_v2(&dptr, size))) {
         *devPtr = dptr;
@@ -220,7 +220,7 @@ int aimdo_cuda_malloc_async(CUdeviceptr *devPtr, size_t size, CUstream hStream,
         return true_cuMemAllocAsync(devPtr, size, hStream);
     }
 
-    vbars_free(budget_deficit(size));
+    vbars_free_deficit(size);
 
     if (CHECK_CU(true_cuMemAllocAsync(&dptr, size, hStream))) {
         *devPtr = dptr;
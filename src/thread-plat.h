@@ -5,6 +5,7 @@
 #if defined(_WIN32) || defined(_WIN64)
 #include <windows.h>
 typedef CRITICAL_SECTION *Mutex;
+typedef SRWLOCK *RwLock;
 typedef CONDITION_VARIABLE *CondVar;
 typedef HANDLE Thread;
 typedef DWORD (WINAPI *ThreadProc)(void *);
@@ -12,6 +13,7 @@ typedef DWORD (WINAPI *ThreadProc)(void *);
 #else
 #include <pthread.h>
 typedef pthread_mutex_t *Mutex;
+typedef pthread_rwlock_t *RwLock;
 typedef pthread_cond_t *CondVar;
 typedef pthread_t Thread;
 typedef void *(*ThreadProc)(void *);
@@ -23,8 +25,17 @@ void mutex_lock(Mutex mutex);
 void mutex_unlock(Mutex mutex);
 void mutex_destroy(Mutex mutex);
 
+RwLock rwlock_create(void);
+void rwlock_read_lock(RwLock rwlock);
+void rwlock_read_unlock(RwLock rwlock);
+void rwlock_write_lock(RwLock rwlock);
+void rwlock_write_unlock(RwLock rwlock);
+void rwlock_destroy(RwLock rwlock);
+
 CondVar condvar_create(void);
 void condvar_wait(CondVar condvar, Mutex mutex);
+/* Returns false on timeout. Spurious wakeups return true, as with condvar_wait(). */
+bool condvar_wait_timeout(CondVar condvar, Mutex mutex, unsigned int timeout_ms);
 void condvar_signal(CondVar condvar);
 void condvar_broadcast(CondVar condvar);
 void condvar_destroy(CondVar condvar);
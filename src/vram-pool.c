@@ -0,0 +1,220 @@
+#include "plat.h"
+
+/* Physical page recycling. Evicted VBAR pages, and the chunks of destroyed
+ * vrambufs that match a VBAR page size, park their handles here instead of
+ * going straight back to the driver, so a thrashing workload pays cuMemMap +
+ * cuMemSetAccess per fault rather than the full cuMemCreate/cuMemRelease churn. Pooled memory stays in total_vram_usage, so
+ * the budget sees it, and vbars_free() drains the pool before evicting anything.
+ *
+ * Everything here runs under the exclusive VBAR lock (vbars_lock_exclusive()).
+ */
+
+/* Orphans are the still-populated pages of freed VBARs, kept by content key so
+ * a later VBAR with the same keys can adopt them (vrampool_adopt()). Newest
+ * first, bounded by vram_orphan_limit, and the first thing given up when
+ * memory is wanted for anything else.
+ */
+
+typedef struct VramPoolEntry {
+    CUmemGenericAllocationHandle handle;
+    size_t size;
+    uint64_t key; /* Orphans only */
+    size_t serial;
+    struct VramPoolEntry *next;
+} VramPoolEntry;
+
+static inline void orphan_unlink(VramPoolEntry **p) {
+    VramPoolEntry *entry = *p;
+
+    *p = entry->next;
+    vram_orphan_size -= entry->size;
+}
+
+bool vrampool_take(size_t size, CUmemGenericAllocationHandle *handle) {
+    VramPoolEntry **oldest = NULL;
+
+    for (VramPoolEntry **p = &vram_pool; *p; p = &(*p)->next) {
+        VramPoolEntry *entry = *p;
+
+        if (entry->size != size) {
+            continue;
+        }
+        *p = entry->next;
+        *handle = entry->handle;
+        vram_pool_size -= size;
+        free(entry);
+        log(VVERBOSE, "%s: size=%zuk pool=%zuk\n", __func__, size / K, (size_t)vram_pool_size / K);
+        return true;
+    }
+
+    /* An orphan's contents are worth less than a fresh page's */
+    for (VramPoolEntry **p = &vram_orphans; *p; p = &(*p)->next) {
+        if ((*p)->size == size) {
+            oldest = p;
+        }
+    }
+    if (oldest) {
+        VramPoolEntry *entry = *oldest;
+
+        orphan_unlink(oldest);
+        *handle = entry->handle;
+        free(entry);
+        log(VVERBOSE, "%s: size=%zuk from orphans=%zuk\n", __func__, size / K,
+            (size_t)vram_orphan_size / K);
+        return true;
+    }
+    return false;
+}
+
+void vrampool_put(CUmemGenericAllocationHandle handle, size_t size) {
+    VramPoolEntry *entry;
+
+    if (vram_pool_size + size > vram_pool_limit ||
+        !(entry = (VramPoolEntry *)malloc(sizeof(*entry)))) {
+        CHECK_CU(cuMemRelease(handle));
+        vram_usage_add(-(int64_t)size);
+        return;
+    }
+
+    entry->handle = handle;
+    entry->size = size;
+    entry->next = vram_pool;
+    vram_pool = entry;
+    vram_pool_size += size;
+    log(VVERBOSE, "%s: size=%zuk pool=%zuk\n", __func__, size / K, (size_t)vram_pool_size / K);
+}
+
+/* Park a populated page of a freed VBAR. Ownership of handle passes to the
+ * cache either way; pages that do not fit push out the oldest orphans.
+ */
+void vrampool_orphan(CUmemGenericAllocationHandle handle, size_t size, uint64_t key, size_t serial) {
+    VramPoolEntry *entry;
+
+    if (size > vram_orphan_limit || !(entry = (VramPoolEntry *)malloc(sizeof(*entry)))) {
+        vrampool_put(handle, size);
+        return;
+    }
+
+    entry->handle = handle;
+    entry->size = size;
+    entry->key = key;
+    entry->serial = serial;
+    entry->next = vram_orphans;
+    vram_orphans = entry;
+    vram_orphan_size += size;
+
+    while (vram_orphan_size > vram_orphan_limit) {
+        VramPoolEntry **p = &vram_orphans;
+
+        while ((*p)->next) {
+            p = &(*p)->next;
+        }
+        entry = *p;
+        orphan_unlink(p);
+        vrampool_put(entry->handle, entry->size);
+        free(entry);
+    }
+    log(VVERBOSE, "%s: key=%016llx orphans=%zuk\n", __func__, (ull)key, (size_t)vram_orphan_size / K);
+}
+
+bool vrampool_adopt(uint64_t key, size_t size, CUmemGenericAllocationHandle *handle, size_t *serial) {
+    for (VramPoolEntry **p = &vram_orphans; *p; p = &(*p)->next) {
+        VramPoolEntry *entry = *p;
+
+        if (entry->key != key || entry->size != size) {
+            continue;
+        }
+        orphan_unlink(p);
+        *handle = entry->handle;
+        *serial = entry->serial;
+        free(entry);
+        log(VERBOSE, "%s: key=%016llx orphans=%zuk\n", __func__, (ull)key, (size_t)vram_orphan_size / K);
+        return true;
+    }
+    return false;
+}
+
+size_t vrampool_available(size_t size) {
+    size_t available = 0;
+
+    for (VramPoolEntry *entry = vram_pool; entry; entry = entry->next) {
+        if (entry->size == size) {
+            available += size;
+        }
+    }
+    for (VramPoolEntry *entry = vram_orphans; entry; entry = entry->next) {
+        if (entry->size == size) {
+            available += size;
+        }
+    }
+    return available;
+}
+
+/* Release up to size bytes back to the driver, sparing handles of keep_size
+ * (0 spares nothing). Orphans go first. Returns the number of bytes released.
+ */
+size_t vrampool_trim(size_t size, size_t keep_size) {
+    size_t released = 0;
+
+    for (VramPoolEntry **p = &vram_orphans; *p && released < size;) {
+        VramPoolEntry *entry = *p;
+
+        if (entry->size == keep_size) {
+            p = &entry->next;
+            continue;
+        }
+        orphan_unlink(p);
+        CHECK_CU(cuMemRelease(entry->handle));
+        vram_usage_add(-(int64_t)entry->size);
+        released += entry->size;
+        free(entry);
+    }
+
+    for (VramPoolEntry **p = &vram_pool; *p && released < size;) {
+        VramPoolEntry *entry = *p;
+
+        if (entry->size == keep_size) {
+            p = &entry->next;
+            continue;
+        }
+        *p = entry->next;
+        CHECK_CU(cuMemRelease(entry->handle));
+        vram_usage_add(-(int64_t)entry->size);
+        vram_pool_size -= entry->size;
+        released += entry->size;
+        free(entry);
+    }
+
+    if (released) {
+        log(DEBUG, "%s: released %zu MB, pool now %zu MB, orphans %zu MB\n", __func__,
+            released / M, (size_t)vram_pool_size / M, (size_t)vram_orphan_size / M);
+    }
+    return released;
+}
+
+SHARED_EXPORT
+void set_vram_pool_limit(void *devctx, uint64_t bytes) {
+    set_devctx((AimdoContext *)devctx);
+    log(DEBUG, "%s: limit=%zu MB\n", __func__, (size_t)bytes / M);
+    vbars_lock_exclusive();
+    vram_pool_limit = bytes;
+    if (vram_pool_size > vram_pool_limit) {
+        vrampool_trim(vram_pool_size - vram_pool_limit, 0);
+    }
+    vbars_unlock_exclusive();
+}
+
+/* Bytes of freed VBAR pages to keep for adoption by content key. 0, the
+ * default, disables the cache.
+ */
+SHARED_EXPORT
+void set_vbar_orphan_cache_limit(void *devctx, uint64_t bytes) {
+    set_devctx((AimdoContext *)devctx);
+    log(DEBUG, "%s: limit=%zu MB\n", __func__, (size_t)bytes / M);
+    vbars_lock_exclusive();
+    vram_orphan_limit = bytes;
+    if (vram_orphan_size > vram_orphan_limit) {
+        vrampool_trim(vram_orphan_size - vram_orphan_limit, 0);
+    }
+    vbars_unlock_exclusive();
+}
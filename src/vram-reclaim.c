@@ -0,0 +1,141 @@
+#include "plat.h"
+#include "thread-plat.h"
+
+/* Optional per-device background reclaimer, kswapd style. It polls the budget
+ * and evicts VBAR pages ahead of demand until vram_reserve more bytes would
+ * fit, so foreground faults and allocations mostly find the memory already
+ * free. Eviction goes in batches with the VBAR lock dropped in between, so
+ * faults are not held up behind a large pass.
+ */
+
+#define VRAM_RECLAIM_INTERVAL_MS 50
+#define VRAM_RECLAIM_BATCH (256ULL * 1024 * 1024)
+
+typedef struct VramReclaimer {
+    AimdoContext *devctx;
+    CUdevice device;
+    CUcontext ctx;
+    Mutex mutex;
+    CondVar wake;
+    Thread thread;
+    bool stop;
+} VramReclaimer;
+
+static THREAD_FUNC vram_reclaim_worker(void *arg) {
+    VramReclaimer *r = (VramReclaimer *)arg;
+
+    set_devctx(r->devctx);
+    CHECK_CU(cuCtxSetCurrent(r->ctx));
+
+    mutex_lock(r->mutex);
+    while (!r->stop) {
+        size_t reserve = vram_reserve;
+        size_t freed;
+
+        mutex_unlock(r->mutex);
+        freed = vbars_reclaim(reserve, VRAM_RECLAIM_BATCH);
+        if (freed) {
+            log(VERBOSE, "%s: evicted %zu MB towards a %zu MB reserve\n", __func__,
+                freed / M, reserve / M);
+        }
+        mutex_lock(r->mutex);
+        if (!freed && !r->stop) {
+            condvar_wait_timeout(r->wake, r->mutex, VRAM_RECLAIM_INTERVAL_MS);
+        }
+    }
+    mutex_unlock(r->mutex);
+
+    CHECK_CU(cuCtxSetCurrent(NULL));
+    return 0;
+}
+
+static void reclaimer_free(VramReclaimer *r) {
+    if (r->ctx) {
+        CHECK_CU(cuDevicePrimaryCtxRelease(r->device));
+    }
+    condvar_destroy(r->wake);
+    mutex_destroy(r->mutex);
+    free(r);
+}
+
+static bool vram_reclaim_start(void) {
+    VramReclaimer *r = (VramReclaimer *)calloc(1, sizeof(*r));
+
+    if (!r) {
+        log(CRITICAL, "Host OOM\n");
+        return false;
+    }
+    r->devctx = g_devctx;
+    if (!CHECK_CU(cuDeviceGet(&r->device, g_devctx->_device_id)) ||
+        !CHECK_CU(cuDevicePrimaryCtxRetain(&r->ctx, r->device))) {
+        r->ctx = NULL;
+        reclaimer_free(r);
+        return false;
+    }
+    if (!(r->mutex = mutex_create()) || !(r->wake = condvar_create()) ||
+        !thread_create(&r->thread, vram_reclaim_worker, r)) {
+        log(ERROR, "%s: could not start the reclaimer thread\n", __func__);
+        reclaimer_free(r);
+        return false;
+    }
+    vram_reclaimer = r;
+    return true;
+}
+
+/* Wake the reclaimer for an early pass, e.g. after a fault missed */
+void vram_reclaim_kick(void) {
+    VramReclaimer *r = (VramReclaimer *)vram_reclaimer;
+
+    if (r) {
+        mutex_lock(r->mutex);
+        condvar_signal(r->wake);
+        mutex_unlock(r->mutex);
+    }
+}
+
+void vram_reclaim_stop(void) {
+    VramReclaimer *r = (VramReclaimer *)vram_reclaimer;
+
+    if (!r) {
+        return;
+    }
+    mutex_lock(r->mutex);
+    r->stop = true;
+    condvar_signal(r->wake);
+    mutex_unlock(r->mutex);
+    thread_join(r->thread);
+
+    vram_reclaimer = NULL;
+    reclaimer_free(r);
+}
+
+/* Keep bytes of VRAM free ahead of demand with a background thread evicting
+ * VBAR pages. 0, the default, stops the thread and leaves eviction to the
+ * faults and allocations that need the memory.
+ */
+SHARED_EXPORT
+bool set_vram_reserve(void *devctx, uint64_t bytes) {
+    VramReclaimer *r;
+
+    set_devctx((AimdoContext *)devctx);
+    log(DEBUG, "%s: reserve=%zu MB\n", __func__, (size_t)bytes / M);
+
+    if (!bytes) {
+        vram_reclaim_stop();
+        vram_reserve = 0;
+        return true;
+    }
+    if (!(r = (VramReclaimer *)vram_reclaimer)) {
+        vram_reserve = bytes;
+        if (!vram_reclaim_start()) {
+            vram_reserve = 0;
+            return false;
+        }
+        return true;
+    }
+    mutex_lock(r->mutex);
+    vram_reserve = bytes;
+    condvar_signal(r->wake);
+    mutex_unlock(r->mutex);
+    return true;
+}
@@ -73,20 +73,26 @@ bool vrambuf_grow(void *arg, size_t required_size) {
         grow_to = buf->max_size;
     }
 
-    vbars_free(budget_deficit(grow_to - buf->allocated));
+    vbars_free_deficit(grow_to - buf->allocated);
     while (buf->allocated < grow_to) {
         size_t to_allocate = grow_to - buf->allocated;
         if (to_allocate > VRAM_CHUNK_SIZE) {
             to_allocate = VRAM_CHUNK_SIZE;
         }
-        if ((err = three_stooges(buf->base_ptr + buf->allocated, to_allocate, buf->device, &handle)) != CUDA_SUCCESS) {
+        vbars_lock_exclusive();
+        err = three_stooges(buf->base_ptr + buf->allocated, to_allocate, buf->device, &handle);
+        vbars_unlock_exclusive();
+        if (err != CUDA_SUCCESS) {
             if (err != CUDA_ERROR_OUT_OF_MEMORY) {
                 log(ERROR, "VRAM Allocation failed (non OOM)\n");
                 return false;
             }
             log(DEBUG, "Pytorch allocator attempt exceeds available VRAM ...\n");
             vbars_free(VRAM_CHUNK_SIZE);
-            if ((err = three_stooges(buf->base_ptr + buf->allocated, to_allocate, buf->device, &handle)) != CUDA_SUCCESS) {
+            vbars_lock_exclusive();
+            err = three_stooges(buf->base_ptr + buf->allocated, to_allocate, buf->device, &handle);
+            vbars_unlock_exclusive();
+            if (err != CUDA_SUCCESS) {
                 bool is_oom = err == CUDA_ERROR_OUT_OF_MEMORY;
                 log(is_oom ? INFO : ERROR, "VRAM Allocation failed (%s)\n", is_oom ? "OOM" : "error");
                 return false;
@@ -124,11 +130,21 @@ bool vrambuf_destroy(void *arg) {
         unmap_workaround(buf->base_ptr, buf->allocated);
     }
 
+    /* Only pool chunks a VBAR fault could take; anything else would sit in
+     * the pool counted as usage until the next trim.
+     */
+    vbars_lock_exclusive();
     for (i = 0; i < buf->handle_count; i++) {
-        CHECK_CU(cuMemRelease(buf->handles[i]));
-    }
+        size_t size = MIN(VRAM_CHUNK_SIZE, buf->allocated - i * VRAM_CHUNK_SIZE);
 
-    total_vram_usage -= buf->allocated;
+        if (vbars_page_size_used(size)) {
+            vrampool_put(buf->handles[i], size);
+        } else {
+            CHECK_CU(cuMemRelease(buf->handles[i]));
+            vram_usage_add(-(int64_t)size);
+        }
+    }
+    vbars_unlock_exclusive();
 
 #if defined(__HIP_PLATFORM_AMD__) && defined(_WIN32)
     /* VRAM freed; keep the VA reservation and park it for reuse. */